@@ -0,0 +1,413 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+// Benchmark for the file processor (main.c). Every operation is run as a
+// separate process over a generated corpus so that fork-based operations
+// (copyN, find) are measured together with their children.
+//
+// Build: gcc -O2 -o bench bench.c
+// Run:   ./bench -b ./2 -o results.json
+
+#define MAX_LIST 16
+
+typedef struct {
+    const char *name;
+    const char *arg;
+} bench_op;
+
+static const bench_op all_ops[] = {
+    {"xorN", "6"},
+    {"mask", "0000000F"},
+    {"copyN", "2"},
+    {"find", "needle-not-present"},
+};
+
+typedef struct {
+    double seconds;
+    long long syscalls;
+    long max_rss_kb;
+    long vcsw;
+    long ivcsw;
+    int exit_status;
+} run_result;
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t next_random() {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int parse_size(const char *str, size_t *res) {
+    char *endptr;
+    errno = 0;
+    unsigned long long value = strtoull(str, &endptr, 10);
+    if (endptr == str || errno == ERANGE || *str == '-') return 1;
+    int shift = 0;
+    switch (*endptr) {
+        case 'K': case 'k': shift = 10; endptr++; break;
+        case 'M': case 'm': shift = 20; endptr++; break;
+        case 'G': case 'g': shift = 30; endptr++; break;
+    }
+    if (*endptr != '\0' || value == 0 || value > (SIZE_MAX >> shift)) return 1;
+    value <<= shift;
+    *res = (size_t)value;
+    return 0;
+}
+
+// The binary path comes from the command line and may contain quotes.
+static void write_json_string(FILE *out, const char *str) {
+    fputc('"', out);
+    for (const unsigned char *p = (const unsigned char *)str; *p; p++) {
+        if (*p == '"' || *p == '\\') {
+            fprintf(out, "\\%c", *p);
+        } else if (*p < 0x20) {
+            fprintf(out, "\\u%04x", *p);
+        } else {
+            fputc(*p, out);
+        }
+    }
+    fputc('"', out);
+}
+
+// Parses a comma separated list ("64K,1M") into values, returns count or -1.
+static int parse_list(char *str, size_t *values, int is_size) {
+    int count = 0;
+    char *saveptr = NULL;
+    for (char *token = strtok_r(str, ",", &saveptr); token; token = strtok_r(NULL, ",", &saveptr)) {
+        if (count == MAX_LIST) return -1;
+        if (is_size) {
+            if (parse_size(token, &values[count]) != 0) return -1;
+        } else {
+            char *endptr;
+            long value = strtol(token, &endptr, 10);
+            if (*endptr != '\0' || value <= 0) return -1;
+            values[count] = (size_t)value;
+        }
+        count++;
+    }
+    return count;
+}
+
+// Text-like content so that `find` (getline based) sees realistic lines,
+// while the binary operations do not care about the byte distribution.
+static int write_corpus_file(const char *path, size_t size) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return 1;
+
+    char buffer[65536];
+    size_t written = 0;
+    while (written < size) {
+        size_t chunk = size - written < sizeof(buffer) ? size - written : sizeof(buffer);
+        for (size_t i = 0; i < chunk; i++) {
+            uint64_t r = next_random();
+            buffer[i] = (r & 63) == 0 ? '\n' : 'a' + (char)((r >> 8) % 26);
+        }
+        if (write(fd, buffer, chunk) != (ssize_t)chunk) {
+            close(fd);
+            return 1;
+        }
+        written += chunk;
+    }
+    close(fd);
+    return 0;
+}
+
+// copyN leaves "<name>_<k>.dat" files behind; corpus files never contain '_'.
+static void remove_copies(const char *dir) {
+    DIR *directory = opendir(dir);
+    if (!directory) return;
+    struct dirent *entry;
+    while ((entry = readdir(directory)) != NULL) {
+        if (strchr(entry->d_name, '_')) {
+            unlinkat(dirfd(directory), entry->d_name, 0);
+        }
+    }
+    closedir(directory);
+}
+
+// Also cleans up a partially created corpus.
+static void remove_corpus(const char *dir, char **paths, int file_count) {
+    remove_copies(dir);
+    for (int i = 0; i < file_count; i++) {
+        unlink(paths[i]);
+        free(paths[i]);
+    }
+    free(paths);
+}
+
+static int create_corpus(const char *dir, size_t size, int file_count, char ***paths) {
+    char **names = calloc(file_count, sizeof(char *));
+    if (!names) return 1;
+    for (int i = 0; i < file_count; i++) {
+        size_t len = strlen(dir) + 32;
+        names[i] = malloc(len);
+        if (!names[i]) {
+            remove_corpus(dir, names, i);
+            return 1;
+        }
+        snprintf(names[i], len, "%s/f%04d.dat", dir, i);
+        if (write_corpus_file(names[i], size) != 0) {
+            fprintf(stderr, "Cannot write corpus file %s\n", names[i]);
+            remove_corpus(dir, names, i + 1);
+            return 1;
+        }
+    }
+    *paths = names;
+    return 0;
+}
+
+// read/write family syscall counter of a zombie child, includes its reaped children.
+static long long read_syscall_count(pid_t pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/io", (int)pid);
+    FILE *file = fopen(path, "r");
+    if (!file) return -1;
+
+    char key[32];
+    long long value;
+    long long total = 0;
+    int found = 0;
+    while (fscanf(file, "%31[^:]: %lld\n", key, &value) == 2) {
+        if (strcmp(key, "syscr") == 0 || strcmp(key, "syscw") == 0) {
+            total += value;
+            found++;
+        }
+    }
+    fclose(file);
+    return found == 2 ? total : -1;
+}
+
+static int run_once(const char *binary, char **paths, int file_count,
+                    const bench_op *op, int verbose, run_result *result) {
+    char **args = malloc((file_count + 4) * sizeof(char *));
+    if (!args) return 1;
+    args[0] = (char *)binary;
+    for (int i = 0; i < file_count; i++) {
+        args[i + 1] = paths[i];
+    }
+    args[file_count + 1] = (char *)op->name;
+    args[file_count + 2] = (char *)op->arg;
+    args[file_count + 3] = NULL;
+
+    double start = now_seconds();
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (!verbose) {
+            int null_fd = open("/dev/null", O_WRONLY);
+            if (null_fd >= 0) {
+                dup2(null_fd, STDOUT_FILENO);
+                close(null_fd);
+            }
+        }
+        execv(binary, args);
+        _exit(127);
+    }
+    free(args);
+    if (pid < 0) {
+        printf("Process creation failed\n");
+        return 1;
+    }
+
+    // Wait without reaping first so /proc/<pid>/io is still readable.
+    siginfo_t info;
+    if (waitid(P_PID, pid, &info, WEXITED | WNOWAIT) != 0) {
+        return 1;
+    }
+    result->seconds = now_seconds() - start;
+    result->syscalls = read_syscall_count(pid);
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) != pid) {
+        return 1;
+    }
+    result->max_rss_kb = usage.ru_maxrss;
+    result->vcsw = usage.ru_nvcsw;
+    result->ivcsw = usage.ru_nivcsw;
+    result->exit_status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    return result->exit_status == 127 ? 1 : 0;
+}
+
+static int compare_results(const void *a, const void *b) {
+    double x = ((const run_result *)a)->seconds;
+    double y = ((const run_result *)b)->seconds;
+    return (x > y) - (x < y);
+}
+
+static void show_usage(const char *program) {
+    printf("Usage: %s [options]\n", program);
+    printf("  -b <path>     file processor binary (default ./2)\n");
+    printf("  -s <sizes>    file sizes, e.g. 64K,1M,8M (default 64K,1M,8M)\n");
+    printf("  -j <counts>   files per run, e.g. 1,4,16 (default 1,4,16)\n");
+    printf("  -r <reps>     repetitions per case, best and median are reported (default 3)\n");
+    printf("  -p <ops>      operations, e.g. xorN,find (default all)\n");
+    printf("  -d <dir>      directory for the generated corpus (default /tmp)\n");
+    printf("  -o <file>     write JSON results to file\n");
+    printf("  -v            keep the output of the file processor\n");
+}
+
+int main(int argc, char *argv[]) {
+    const char *binary = "./2";
+    const char *json_path = NULL;
+    const char *base_dir = "/tmp";
+    char default_sizes[] = "64K,1M,8M";
+    char default_counts[] = "1,4,16";
+    char *sizes_arg = default_sizes;
+    char *counts_arg = default_counts;
+    char *ops_arg = NULL;
+    int reps = 3;
+    int verbose = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:s:j:r:p:d:o:vh")) != -1) {
+        switch (opt) {
+            case 'b': binary = optarg; break;
+            case 's': sizes_arg = optarg; break;
+            case 'j': counts_arg = optarg; break;
+            case 'r': reps = atoi(optarg); break;
+            case 'p': ops_arg = optarg; break;
+            case 'd': base_dir = optarg; break;
+            case 'o': json_path = optarg; break;
+            case 'v': verbose = 1; break;
+            default:
+                show_usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    size_t sizes[MAX_LIST];
+    size_t counts[MAX_LIST];
+    int size_count = parse_list(sizes_arg, sizes, 1);
+    int count_count = parse_list(counts_arg, counts, 0);
+    if (size_count <= 0 || count_count <= 0 || reps <= 0) {
+        printf("Error: invalid sizes, counts or repetitions.\n");
+        return 1;
+    }
+    if (access(binary, X_OK) != 0) {
+        printf("Error: file processor binary %s is not executable.\n", binary);
+        return 1;
+    }
+
+    int op_enabled[sizeof(all_ops) / sizeof(all_ops[0])];
+    for (size_t i = 0; i < sizeof(all_ops) / sizeof(all_ops[0]); i++) {
+        op_enabled[i] = ops_arg == NULL || strstr(ops_arg, all_ops[i].name) != NULL;
+    }
+
+    char dir[4096];
+    snprintf(dir, sizeof(dir), "%s/fp_bench_XXXXXX", base_dir);
+    if (!mkdtemp(dir)) {
+        printf("Error: cannot create corpus directory in %s\n", base_dir);
+        return 1;
+    }
+
+    FILE *json = NULL;
+    if (json_path) {
+        json = fopen(json_path, "w");
+        if (!json) {
+            printf("Error: cannot open %s\n", json_path);
+            rmdir(dir);
+            return 1;
+        }
+        fprintf(json, "{\"binary\": ");
+        write_json_string(json, binary);
+        fprintf(json, ", \"reps\": %d, \"results\": [\n", reps);
+    }
+
+    run_result *runs = malloc(reps * sizeof(run_result));
+    if (!runs) {
+        printf("Cannot allocate memory for results\n");
+        if (json) fclose(json);
+        rmdir(dir);
+        return 1;
+    }
+
+    printf("%-6s %10s %6s %10s %10s %10s %12s %10s %8s\n",
+           "op", "size", "files", "best_s", "median_s", "MB/s", "files/s", "syscalls", "rss_kb");
+
+    int failed = 0;
+    int first_record = 1;
+    for (int s = 0; s < size_count && !failed; s++) {
+        for (int c = 0; c < count_count && !failed; c++) {
+            char **paths;
+            int file_count = (int)counts[c];
+            if (create_corpus(dir, sizes[s], file_count, &paths) != 0) {
+                failed = 1;
+                break;
+            }
+
+            for (size_t o = 0; o < sizeof(all_ops) / sizeof(all_ops[0]); o++) {
+                if (!op_enabled[o]) continue;
+                const bench_op *op = &all_ops[o];
+
+                for (int r = 0; r < reps; r++) {
+                    if (run_once(binary, paths, file_count, op, verbose, &runs[r]) != 0) {
+                        printf("Error: %s failed to run\n", op->name);
+                        failed = 1;
+                        break;
+                    }
+                    remove_copies(dir);
+                }
+                if (failed) break;
+
+                qsort(runs, reps, sizeof(run_result), compare_results);
+                run_result *best = &runs[0];
+                run_result *median = &runs[reps / 2];
+
+                // copyN writes every input byte N times, the rest read it once.
+                double bytes = (double)sizes[s] * file_count;
+                if (strcmp(op->name, "copyN") == 0) {
+                    bytes *= atoi(op->arg);
+                }
+                double mb_per_s = bytes / (1 << 20) / median->seconds;
+                double files_per_s = file_count / median->seconds;
+
+                printf("%-6s %10zu %6d %10.4f %10.4f %10.1f %12.1f %10lld %8ld\n",
+                       op->name, sizes[s], file_count, best->seconds, median->seconds,
+                       mb_per_s, files_per_s, median->syscalls, median->max_rss_kb);
+
+                if (json) {
+                    fprintf(json,
+                            "%s  {\"op\": \"%s\", \"arg\": \"%s\", \"size\": %zu, \"files\": %d, "
+                            "\"best_s\": %.6f, \"median_s\": %.6f, \"mb_per_s\": %.2f, "
+                            "\"files_per_s\": %.2f, \"syscalls\": %lld, \"max_rss_kb\": %ld, "
+                            "\"vcsw\": %ld, \"ivcsw\": %ld, \"exit_status\": %d}",
+                            first_record ? "" : ",\n", op->name, op->arg, sizes[s], file_count,
+                            best->seconds, median->seconds, mb_per_s, files_per_s,
+                            median->syscalls, median->max_rss_kb, median->vcsw, median->ivcsw,
+                            median->exit_status);
+                    first_record = 0;
+                }
+            }
+
+            remove_corpus(dir, paths, file_count);
+        }
+    }
+
+    if (json) {
+        fprintf(json, "\n]}\n");
+        fclose(json);
+    }
+    free(runs);
+    rmdir(dir);
+
+    return failed;
+}
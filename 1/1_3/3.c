@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <pthread.h>
 #include <semaphore.h>
@@ -6,11 +7,916 @@
 #include <limits.h>
 #include <time.h>
 #include <string.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdalign.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <errno.h>
+
+#define THREAD_STACK_SIZE (128 * 1024)
+#define TRACE_RING_SIZE 256          // events per philosopher, power of two
+#define TRACE_DRAIN_INTERVAL_US 1000
+
+enum strategy {
+    STRATEGY_WAITER,   // N-1 seats at the table (the original solution)
+    STRATEGY_ORDERED,  // resource hierarchy: lower numbered fork first
+    STRATEGY_CHANDY    // Chandy-Misra clean/dirty forks
+};
+
+const char *strategy_names[] = {"waiter", "ordered", "chandy"};
 
 int N;
-sem_t *forks;  sem_t mutex;   
-int meals_count = 10;  
-int use_synchronization = 1;  
+sem_t mutex;
+int meals_count = 10;
+int use_synchronization = 1;
+enum strategy strategy = STRATEGY_WAITER;
+int bench_mode = 0;             // no sleeps and no per-event output
+int bench_duration_ms = 1000;
+int bench_cpus = 0;             // 0: no pinning
+atomic_int stop_dining;
+long *meals_done;
+pthread_barrier_t start_barrier;
+
+// PCG32: one generator per thread, seeded from --seed and the thread's index,
+// so timings are reproducible and rand()'s global lock is gone.
+typedef struct {
+    uint64_t state;
+    uint64_t inc;
+} pcg32;
+
+uint64_t rng_seed;
+_Thread_local pcg32 thread_rng;
+
+uint32_t pcg32_next(pcg32 *rng) {
+    uint64_t old = rng->state;
+    rng->state = old * 6364136223846793005ULL + rng->inc;
+    uint32_t xorshifted = (uint32_t)(((old >> 18) ^ old) >> 27);
+    uint32_t rot = (uint32_t)(old >> 59);
+    return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+}
+
+void pcg32_init(pcg32 *rng, uint64_t seed, uint64_t stream) {
+    rng->state = 0;
+    rng->inc = (stream << 1) | 1;
+    pcg32_next(rng);
+    rng->state += seed;
+    pcg32_next(rng);
+}
+
+// Uniform in [0, bound).
+uint32_t pcg32_below(pcg32 *rng, uint32_t bound) {
+    return (uint32_t)(((uint64_t)pcg32_next(rng) * bound) >> 32);
+}
+
+uint32_t random_below(uint32_t bound) {
+    return pcg32_below(&thread_rng, bound);
+}
+
+// Tracing: every philosopher writes timestamped binary events into its own
+// single-producer ring, a drainer thread merges the rings by time and renders
+// the events as text and/or appends them to a binary trace file.
+// Philosophers never touch stdio, so a full ring drops the event instead of
+// blocking.
+enum event_type {
+    EVENT_THINK,
+    EVENT_PICK_LEFT,
+    EVENT_PICK_RIGHT,
+    EVENT_EAT,
+    EVENT_PUT_LEFT,
+    EVENT_PUT_RIGHT,
+    EVENT_DONE,
+    EVENT_BACKOFF
+};
+
+typedef struct {
+    uint64_t time_ns;
+    int32_t philosopher;
+    int32_t type;
+    int32_t arg;       // fork index, or meals eaten so far
+    int32_t reserved;
+} trace_record;
+
+typedef struct {
+    char magic[4];     // "PHTR"
+    int32_t version;
+    int32_t philosophers;
+    int32_t meals_count;  // 0 for benchmark runs
+} trace_header;
+
+typedef struct {
+    alignas(64) _Atomic uint64_t head;  // written by the philosopher
+    atomic_int stamping;                // an event is being timestamped
+    uint64_t dropped;
+    alignas(64) _Atomic uint64_t tail;  // written by the drainer
+    alignas(64) trace_record events[TRACE_RING_SIZE];
+} trace_ring;
+
+int tracing = 0;
+int trace_text = 1;
+const char *trace_path = NULL;
+FILE *trace_file;
+trace_ring *trace_rings;
+trace_record *trace_batch;
+uint64_t *trace_heads;          // drainer only: heads seen in the current drain
+int *trace_heap;                // drainer only: rings ordered by their oldest event
+pthread_t trace_thread;
+atomic_int trace_stop;
+
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void trace_event(int id, int type, int arg) {
+    if (!tracing) {
+        return;
+    }
+    trace_ring *ring = &trace_rings[id];
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) == TRACE_RING_SIZE) {
+        ring->dropped++;
+        return;
+    }
+    // Announced before the clock is read, so a drainer that misses the
+    // announcement knows this event is stamped after its own clock read.
+    atomic_store(&ring->stamping, 1);
+    trace_record *record = &ring->events[head & (TRACE_RING_SIZE - 1)];
+    record->time_ns = now_ns();
+    record->philosopher = id;
+    record->type = type;
+    record->arg = arg;
+    record->reserved = 0;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    atomic_store_explicit(&ring->stamping, 0, memory_order_release);
+}
+
+void render_record(const trace_record *record, int meals) {
+    int id = record->philosopher + 1;
+    switch (record->type) {
+        case EVENT_THINK:
+            if (meals) printf("Philosopher %d is thinking... (meals left: %d)\n", id, meals - record->arg);
+            else printf("Philosopher %d is thinking... (meals eaten: %d)\n", id, record->arg);
+            break;
+        case EVENT_PICK_LEFT:
+            printf("Philosopher %d picked up left fork %d\n", id, record->arg + 1);
+            break;
+        case EVENT_PICK_RIGHT:
+            printf("Philosopher %d picked up right fork %d\n", id, record->arg + 1);
+            break;
+        case EVENT_EAT:
+            if (meals) printf("Philosopher %d is eating... (meals left: %d)\n", id, meals - record->arg - 1);
+            else printf("Philosopher %d is eating... (meals eaten: %d)\n", id, record->arg);
+            break;
+        case EVENT_PUT_LEFT:
+            printf("Philosopher %d put down left fork %d\n", id, record->arg + 1);
+            break;
+        case EVENT_PUT_RIGHT:
+            printf("Philosopher %d put down right fork %d\n", id, record->arg + 1);
+            break;
+        case EVENT_DONE:
+            printf("Philosopher %d has finished dining.\n", id);
+            break;
+        case EVENT_BACKOFF:
+            printf("Philosopher %d backs off waiting for fork %d\n", id, record->arg + 1);
+            break;
+    }
+}
+
+uint64_t trace_oldest(int ring_id) {
+    trace_ring *ring = &trace_rings[ring_id];
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    return ring->events[tail & (TRACE_RING_SIZE - 1)].time_ns;
+}
+
+void trace_sift_down(int count, int root) {
+    while (2 * root + 1 < count) {
+        int child = 2 * root + 1;
+        if (child + 1 < count && trace_oldest(trace_heap[child + 1]) < trace_oldest(trace_heap[child])) {
+            child++;
+        }
+        if (trace_oldest(trace_heap[root]) <= trace_oldest(trace_heap[child])) {
+            break;
+        }
+        int swap = trace_heap[root];
+        trace_heap[root] = trace_heap[child];
+        trace_heap[child] = swap;
+        root = child;
+    }
+}
+
+// Every ring is already in time order, so the rings are merged through a
+// heap keyed by their oldest event. Only events up to a watermark are
+// written: the drain's start time, lowered to the newest published event of
+// any ring whose philosopher is stamping an event right now. Anything
+// newer stays in its ring for the next drain, so the output is in global
+// time order.
+void trace_drain(int final) {
+    uint64_t watermark = final ? UINT64_MAX : now_ns();
+    int heap_count = 0;
+    for (int i = 0; i < N; i++) {
+        trace_ring *ring = &trace_rings[i];
+        int stamping = atomic_load(&ring->stamping);
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        trace_heads[i] = head;
+        if (stamping && !final) {
+            uint64_t bound = head > 0 ? ring->events[(head - 1) & (TRACE_RING_SIZE - 1)].time_ns : 0;
+            if (bound < watermark) {
+                watermark = bound;
+            }
+        }
+        if (tail != head) {
+            trace_heap[heap_count++] = i;
+        }
+    }
+    for (int i = heap_count / 2 - 1; i >= 0; i--) {
+        trace_sift_down(heap_count, i);
+    }
+
+    size_t count = 0;
+    while (heap_count > 0 && trace_oldest(trace_heap[0]) <= watermark) {
+        trace_ring *ring = &trace_rings[trace_heap[0]];
+        uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        trace_batch[count++] = ring->events[tail & (TRACE_RING_SIZE - 1)];
+        atomic_store_explicit(&ring->tail, ++tail, memory_order_release);
+        if (tail == trace_heads[trace_heap[0]]) {
+            trace_heap[0] = trace_heap[--heap_count];
+        }
+        trace_sift_down(heap_count, 0);
+    }
+    if (count == 0) {
+        return;
+    }
+
+    if (trace_file) {
+        fwrite(trace_batch, sizeof(trace_record), count, trace_file);
+    }
+    if (trace_text) {
+        int meals = bench_mode ? 0 : meals_count;
+        for (size_t i = 0; i < count; i++) {
+            render_record(&trace_batch[i], meals);
+        }
+        fflush(stdout);
+    }
+}
+
+void* trace_drainer(void *arg) {
+    (void)arg;
+    while (!atomic_load(&trace_stop)) {
+        trace_drain(0);
+        usleep(TRACE_DRAIN_INTERVAL_US);
+    }
+    trace_drain(1);
+    return NULL;
+}
+
+void trace_free() {
+    free(trace_rings);
+    free(trace_batch);
+    free(trace_heads);
+    free(trace_heap);
+}
+
+int trace_start(pthread_t *drainer) {
+    // posix_memalign keeps the producer and consumer indices on separate lines.
+    if (posix_memalign((void **)&trace_rings, 64, N * sizeof(trace_ring)) != 0) {
+        return 1;
+    }
+    trace_batch = malloc((size_t)N * TRACE_RING_SIZE * sizeof(trace_record));
+    trace_heads = malloc(N * sizeof(uint64_t));
+    trace_heap = malloc(N * sizeof(int));
+    if (!trace_batch || !trace_heads || !trace_heap) {
+        trace_free();
+        return 1;
+    }
+    for (int i = 0; i < N; i++) {
+        atomic_init(&trace_rings[i].head, 0);
+        atomic_init(&trace_rings[i].stamping, 0);
+        atomic_init(&trace_rings[i].tail, 0);
+        trace_rings[i].dropped = 0;
+    }
+
+    if (trace_path) {
+        trace_file = fopen(trace_path, "wb");
+        if (!trace_file) {
+            fprintf(stderr, "Error: cannot open trace file %s\n", trace_path);
+            trace_free();
+            return 1;
+        }
+        trace_header header = {{'P', 'H', 'T', 'R'}, 1, N, bench_mode ? 0 : meals_count};
+        fwrite(&header, sizeof(header), 1, trace_file);
+    }
+
+    if (pthread_create(drainer, NULL, trace_drainer, NULL) != 0) {
+        fprintf(stderr, "Error: Failed to create trace drainer thread.\n");
+        if (trace_file) fclose(trace_file);
+        trace_free();
+        return 1;
+    }
+    trace_thread = *drainer;
+    return 0;
+}
+
+// Drains everything published so far and closes the trace file. The rings
+// stay allocated: philosophers may still be running.
+void trace_stop_drainer(pthread_t drainer) {
+    atomic_store(&trace_stop, 1);
+    pthread_join(drainer, NULL);
+    if (trace_file) {
+        fclose(trace_file);
+        trace_file = NULL;
+    }
+}
+
+void trace_finish(pthread_t drainer) {
+    trace_stop_drainer(drainer);
+
+    uint64_t dropped = 0;
+    for (int i = 0; i < N; i++) {
+        dropped += trace_rings[i].dropped;
+    }
+    if (dropped) {
+        fprintf(stderr, "Trace: %llu events dropped (ring full)\n", (unsigned long long)dropped);
+    }
+    trace_free();
+}
+
+// Renders a binary trace written with --trace=FILE.
+int render_trace_file(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        fprintf(stderr, "Error: cannot open trace file %s\n", path);
+        return 1;
+    }
+    trace_header header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, "PHTR", 4) != 0) {
+        fprintf(stderr, "Error: %s is not a trace file\n", path);
+        fclose(file);
+        return 1;
+    }
+    trace_record record;
+    while (fread(&record, sizeof(record), 1, file) == 1) {
+        printf("[%12.6f] ", record.time_ns / 1e9);
+        render_record(&record, header.meals_count);
+    }
+    fclose(file);
+    return 0;
+}
+
+// Chandy-Misra: every fork belongs to one of its two neighbours. A dirty fork
+// is handed over on request unless its owner is eating, a clean one is kept
+// until the owner has eaten with it. The hand-over is done by the requester
+// on behalf of the owner, under the fork lock.
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int owner;
+    int dirty;
+} chandy_fork;
+
+chandy_fork *chandy_forks;
+int *chandy_eating;  // written with both fork locks held
+
+
+void chandy_take(int id, int fork_id) {
+    chandy_fork *fork = &chandy_forks[fork_id];
+    pthread_mutex_lock(&fork->lock);
+    while (fork->owner != id && (!fork->dirty || chandy_eating[fork->owner])) {
+        pthread_cond_wait(&fork->cond, &fork->lock);
+    }
+    if (fork->owner != id) {
+        fork->owner = id;
+        fork->dirty = 0;
+    }
+    pthread_mutex_unlock(&fork->lock);
+}
+
+void chandy_pick_up(int id, int left_fork, int right_fork) {
+    int first = left_fork < right_fork ? left_fork : right_fork;
+    int second = left_fork < right_fork ? right_fork : left_fork;
+
+    // A dirty fork may be taken away while the other one is being fetched,
+    // so ownership of both is confirmed atomically before eating.
+    while (1) {
+        chandy_take(id, left_fork);
+        chandy_take(id, right_fork);
+
+        pthread_mutex_lock(&chandy_forks[first].lock);
+        pthread_mutex_lock(&chandy_forks[second].lock);
+        int owns_both = chandy_forks[left_fork].owner == id && chandy_forks[right_fork].owner == id;
+        if (owns_both) {
+            chandy_eating[id] = 1;
+        }
+        pthread_mutex_unlock(&chandy_forks[second].lock);
+        pthread_mutex_unlock(&chandy_forks[first].lock);
+        if (owns_both) {
+            return;
+        }
+    }
+}
+
+void chandy_put_down(int id, int left_fork, int right_fork) {
+    int first = left_fork < right_fork ? left_fork : right_fork;
+    int second = left_fork < right_fork ? right_fork : left_fork;
+
+    pthread_mutex_lock(&chandy_forks[first].lock);
+    pthread_mutex_lock(&chandy_forks[second].lock);
+    chandy_eating[id] = 0;
+    chandy_forks[left_fork].dirty = 1;
+    chandy_forks[right_fork].dirty = 1;
+    pthread_cond_broadcast(&chandy_forks[left_fork].cond);
+    pthread_cond_broadcast(&chandy_forks[right_fork].cond);
+    pthread_mutex_unlock(&chandy_forks[second].lock);
+    pthread_mutex_unlock(&chandy_forks[first].lock);
+}
+
+// Wait-to-eat latency histograms, HDR style: values below 2^HIST_SUB_BITS
+// get exact buckets, above that each power of two is split into HIST_SUB
+// linear buckets (about 12% precision) up to 2^HIST_MAX_BITS ns. Every
+// histogram has a single writer, so counters are bumped with relaxed
+// load/store pairs and can be read at any time without locks.
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 40
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct {
+    _Atomic uint64_t buckets[HIST_BUCKETS];
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum;
+    _Atomic uint64_t max;
+} latency_histogram;
+
+latency_histogram *wait_histograms;
+const char *json_path = NULL;   // "-" for stdout
+
+int hist_index(uint64_t value) {
+    if (value >= (1ULL << HIST_MAX_BITS)) {
+        value = (1ULL << HIST_MAX_BITS) - 1;
+    }
+    if (value < HIST_SUB) {
+        return (int)value;
+    }
+    int shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + (int)((value >> shift) & (HIST_SUB - 1));
+}
+
+// Highest value that falls into the bucket.
+uint64_t hist_bucket_high(int index) {
+    if (index < HIST_SUB) {
+        return (uint64_t)index;
+    }
+    int shift = index / HIST_SUB - 1;
+    uint64_t sub = (uint64_t)(index % HIST_SUB);
+    return ((HIST_SUB + sub + 1) << shift) - 1;
+}
+
+void hist_bump(_Atomic uint64_t *counter, uint64_t delta) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + delta,
+                          memory_order_relaxed);
+}
+
+void hist_record(latency_histogram *histogram, uint64_t value) {
+    hist_bump(&histogram->buckets[hist_index(value)], 1);
+    hist_bump(&histogram->count, 1);
+    hist_bump(&histogram->sum, value);
+    if (value > atomic_load_explicit(&histogram->max, memory_order_relaxed)) {
+        atomic_store_explicit(&histogram->max, value, memory_order_relaxed);
+    }
+}
+
+void hist_merge(latency_histogram *into, latency_histogram *from) {
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        hist_bump(&into->buckets[i], atomic_load_explicit(&from->buckets[i], memory_order_relaxed));
+    }
+    hist_bump(&into->count, atomic_load_explicit(&from->count, memory_order_relaxed));
+    hist_bump(&into->sum, atomic_load_explicit(&from->sum, memory_order_relaxed));
+    uint64_t max = atomic_load_explicit(&from->max, memory_order_relaxed);
+    if (max > atomic_load_explicit(&into->max, memory_order_relaxed)) {
+        atomic_store_explicit(&into->max, max, memory_order_relaxed);
+    }
+}
+
+uint64_t hist_percentile(latency_histogram *histogram, double quantile) {
+    uint64_t count = atomic_load_explicit(&histogram->count, memory_order_relaxed);
+    uint64_t max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+    if (count == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(quantile * count);
+    if (rank < quantile * count || rank < 1) rank++;
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += atomic_load_explicit(&histogram->buckets[i], memory_order_relaxed);
+        if (seen >= rank) {
+            uint64_t high = hist_bucket_high(i);
+            return high < max ? high : max;
+        }
+    }
+    return max;
+}
+
+const char *format_duration(uint64_t ns, char *buffer, size_t size) {
+    if (ns < 1000) snprintf(buffer, size, "%llu ns", (unsigned long long)ns);
+    else if (ns < 1000000) snprintf(buffer, size, "%.2f us", ns / 1e3);
+    else if (ns < 1000000000) snprintf(buffer, size, "%.2f ms", ns / 1e6);
+    else snprintf(buffer, size, "%.2f s", ns / 1e9);
+    return buffer;
+}
+
+latency_histogram *hist_alloc(int count) {
+    latency_histogram *histograms;
+    if (posix_memalign((void **)&histograms, 64, (size_t)count * sizeof(latency_histogram)) != 0) {
+        return NULL;
+    }
+    memset(histograms, 0, (size_t)count * sizeof(latency_histogram));
+    return histograms;
+}
+
+// Fork primitives for the semaphore-based strategies. Every fork sits in
+// its own cache line so neighbours do not bounce each other's lines.
+// The futex fork is the classic three-state lock (0 free, 1 taken,
+// 2 taken with sleepers); the spin fork tries for a while before sleeping
+// on the same futex word.
+#define FORK_SPIN_TRIES 200
+
+enum fork_kind {
+    FORK_SEM,
+    FORK_MUTEX,
+    FORK_FUTEX,
+    FORK_SPIN
+};
+
+const char *fork_kind_names[] = {"sem", "mutex", "futex", "spin"};
+
+typedef struct {
+    alignas(64) union {
+        sem_t sem;
+        pthread_mutex_t mutex;
+        atomic_int word;
+    };
+} padded_fork;
+
+enum fork_kind fork_kind = FORK_SEM;
+
+// Spin-wait hint for the fork's spin phase.
+void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ volatile("yield" ::: "memory");
+#else
+    __asm__ volatile("" ::: "memory");
+#endif
+}
+
+long futex_call(atomic_int *word, int op, int value, const struct timespec *timeout) {
+    return syscall(SYS_futex, word, op, value, timeout, NULL, 0);
+}
+
+// Returns 0 when the fork was taken, 1 on timeout (timeout may be NULL).
+int futex_fork_lock(atomic_int *word, const struct timespec *timeout) {
+    int c = 0;
+    if (fork_kind == FORK_SPIN) {
+        for (int i = 0; i < FORK_SPIN_TRIES; i++) {
+            c = 0;
+            if (atomic_load_explicit(word, memory_order_relaxed) == 0 &&
+                atomic_compare_exchange_weak_explicit(word, &c, 1, memory_order_acquire, memory_order_relaxed)) {
+                return 0;
+            }
+            cpu_relax();
+        }
+        c = 0;
+    }
+    if (atomic_compare_exchange_strong(word, &c, 1)) {
+        return 0;
+    }
+    if (c != 2) {
+        c = atomic_exchange(word, 2);
+    }
+    while (c != 0) {
+        if (futex_call(word, FUTEX_WAIT_PRIVATE, 2, timeout) != 0 && errno == ETIMEDOUT) {
+            return 1;  // the word stays 2, which only costs the holder a spare wake
+        }
+        c = atomic_exchange(word, 2);
+    }
+    return 0;
+}
+
+void futex_fork_unlock(atomic_int *word) {
+    if (atomic_fetch_sub(word, 1) != 1) {
+        atomic_store(word, 0);
+        futex_call(word, FUTEX_WAKE_PRIVATE, 1, NULL);
+    }
+}
+
+int fork_init(padded_fork *fork) {
+    switch (fork_kind) {
+        case FORK_SEM: return sem_init(&fork->sem, 0, 1);
+        case FORK_MUTEX: return pthread_mutex_init(&fork->mutex, NULL);
+        default: atomic_init(&fork->word, 0); return 0;
+    }
+}
+
+void fork_destroy(padded_fork *fork) {
+    switch (fork_kind) {
+        case FORK_SEM: sem_destroy(&fork->sem); break;
+        case FORK_MUTEX: pthread_mutex_destroy(&fork->mutex); break;
+        default: break;
+    }
+}
+
+void fork_acquire(padded_fork *fork) {
+    switch (fork_kind) {
+        case FORK_SEM: sem_wait(&fork->sem); break;
+        case FORK_MUTEX: pthread_mutex_lock(&fork->mutex); break;
+        default: futex_fork_lock(&fork->word, NULL); break;
+    }
+}
+
+// Returns 0 when the fork was taken within timeout_ns.
+int fork_timed_acquire(padded_fork *fork, long timeout_ns) {
+    if (fork_kind == FORK_FUTEX || fork_kind == FORK_SPIN) {
+        struct timespec relative = {0, timeout_ns};
+        return futex_fork_lock(&fork->word, &relative);
+    }
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += timeout_ns;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    if (fork_kind == FORK_SEM) {
+        return sem_timedwait(&fork->sem, &deadline) != 0;
+    }
+    return pthread_mutex_timedlock(&fork->mutex, &deadline) != 0;
+}
+
+void fork_release(padded_fork *fork) {
+    switch (fork_kind) {
+        case FORK_SEM: sem_post(&fork->sem); break;
+        case FORK_MUTEX: pthread_mutex_unlock(&fork->mutex); break;
+        default: futex_fork_unlock(&fork->word); break;
+    }
+}
+
+padded_fork *forks;
+
+// Deadlock watchdog. Philosophers publish what they wait for and what they
+// hold; every word carries the philosopher's wait episode so that a cycle
+// seen in two consecutive scans is known to be the same, still blocked,
+// set of waits rather than an inconsistent snapshot.
+int detect_deadlocks = -1;      // -1: on for nosync only
+int break_deadlocks = 0;
+int detect_interval_us = 1000;
+_Atomic uint64_t *waiting_for;  // (episode << 32) | (fork + 1), 0 when not waiting
+_Atomic uint64_t *fork_holder;  // (episode << 32) | (philosopher + 1), 0 when free
+uint32_t *wait_episode;         // private to each philosopher
+atomic_int *backoff_requested;
+atomic_int watchdog_stop;
+unsigned long watchdog_scans = 0;
+uint64_t watchdog_scan_ns = 0;
+unsigned long deadlocks_found = 0;
+
+// Returns 1 when the watchdog asked this philosopher to back off.
+int take_fork(int id, int fork_id, int event) {
+    uint64_t episode = 0;
+    if (detect_deadlocks) {
+        episode = ++wait_episode[id];
+        atomic_store_explicit(&waiting_for[id], (episode << 32) | (uint32_t)(fork_id + 1), memory_order_release);
+    }
+
+    if (break_deadlocks) {
+        while (1) {
+            if (fork_timed_acquire(&forks[fork_id], 1000000) == 0) {
+                break;
+            }
+            if (atomic_load(&backoff_requested[id])) {
+                atomic_store_explicit(&waiting_for[id], 0, memory_order_release);
+                return 1;
+            }
+        }
+    } else {
+        fork_acquire(&forks[fork_id]);
+    }
+
+    if (detect_deadlocks) {
+        atomic_store_explicit(&fork_holder[fork_id], (episode << 32) | (uint32_t)(id + 1), memory_order_release);
+        atomic_store_explicit(&waiting_for[id], 0, memory_order_release);
+    }
+    trace_event(id, event, fork_id);
+    return 0;
+}
+
+void drop_fork(int id, int fork_id, int event) {
+    if (detect_deadlocks) {
+        atomic_store_explicit(&fork_holder[fork_id], 0, memory_order_release);
+    }
+    fork_release(&forks[fork_id]);
+    trace_event(id, event, fork_id);
+}
+
+// The philosopher holding the fork p waits for, -1 when p does not wait.
+// take_fork publishes the holder before it clears waiting_for, so p may
+// briefly hold the very fork it still seems to wait for: not an edge.
+int wait_target(const uint64_t *waits, const uint64_t *holds, int p) {
+    if (waits[p] == 0) {
+        return -1;
+    }
+    int fork_id = (int)(waits[p] & 0xffffffff) - 1;
+    int holder = (int)(holds[fork_id] & 0xffffffff) - 1;
+    return holder == p ? -1 : holder;
+}
+
+// Follows the wait-for graph (each philosopher waits for at most one fork,
+// so every node has at most one outgoing edge). Stores the first cycle found
+// into cycle[] and returns its length, 0 when there is none.
+int find_wait_cycle(uint64_t *waits, uint64_t *holds, int *mark, int *cycle) {
+    for (int i = 0; i < N; i++) {
+        waits[i] = atomic_load_explicit(&waiting_for[i], memory_order_acquire);
+        holds[i] = atomic_load_explicit(&fork_holder[i], memory_order_acquire);
+        mark[i] = -1;
+    }
+
+    for (int i = 0; i < N; i++) {
+        int p = i;
+        while (p >= 0 && mark[p] < 0) {
+            mark[p] = i;
+            p = wait_target(waits, holds, p);
+        }
+        if (p < 0 || mark[p] != i) {
+            continue;
+        }
+        int length = 0;
+        int q = p;
+        do {
+            cycle[length++] = q;
+            q = wait_target(waits, holds, q);
+        } while (q != p);
+        return length;
+    }
+    return 0;
+}
+
+void report_deadlock(int *cycle, int length, uint64_t *waits) {
+    fprintf(stderr, "Deadlock detected (%d philosophers):", length);
+    for (int i = 0; i < length; i++) {
+        int fork_id = (int)(waits[cycle[i]] & 0xffffffff) - 1;
+        fprintf(stderr, " P%d -[fork %d]->", cycle[i] + 1, fork_id + 1);
+    }
+    fprintf(stderr, " P%d\n", cycle[0] + 1);
+}
+
+void* deadlock_watchdog(void *arg) {
+    (void)arg;
+    uint64_t *waits = malloc(N * sizeof(uint64_t));
+    uint64_t *holds = malloc(N * sizeof(uint64_t));
+    uint64_t *candidate = malloc(2 * N * sizeof(uint64_t));
+    int *mark = malloc(N * sizeof(int));
+    int *cycle = malloc(N * sizeof(int));
+    if (!waits || !holds || !candidate || !mark || !cycle) {
+        fprintf(stderr, "Error: deadlock watchdog is out of memory.\n");
+        free(waits); free(holds); free(candidate); free(mark); free(cycle);
+        return NULL;
+    }
+    int candidate_length = 0;
+
+    while (!atomic_load(&watchdog_stop)) {
+        usleep(detect_interval_us);
+
+        uint64_t scan_start = now_ns();
+        int length = find_wait_cycle(waits, holds, mark, cycle);
+        int confirmed = 0;
+        if (length > 0) {
+            // The same cycle twice in a row: every philosopher still in the
+            // same wait episode, every fork still held by the same holder
+            // from the same acquisition.
+            confirmed = length == candidate_length;
+            for (int i = 0; i < length; i++) {
+                int fork_id = (int)(waits[cycle[i]] & 0xffffffff) - 1;
+                confirmed = confirmed && candidate[2 * i] == waits[cycle[i]] &&
+                            candidate[2 * i + 1] == holds[fork_id];
+                candidate[2 * i] = waits[cycle[i]];
+                candidate[2 * i + 1] = holds[fork_id];
+            }
+        }
+        candidate_length = length;
+        watchdog_scan_ns += now_ns() - scan_start;
+        watchdog_scans++;
+
+        if (!confirmed) {
+            continue;
+        }
+        if (break_deadlocks && atomic_load(&backoff_requested[cycle[0]])) {
+            continue;  // the victim has not reacted yet
+        }
+        deadlocks_found++;
+        report_deadlock(cycle, length, waits);
+        if (!break_deadlocks) {
+            // The blocked philosophers never finish, so the trace is drained
+            // here or its buffered events are lost.
+            if (tracing) {
+                trace_stop_drainer(trace_thread);
+            }
+            fflush(stdout);
+            exit(2);
+        }
+        atomic_store(&backoff_requested[cycle[0]], 1);
+        candidate_length = 0;
+    }
+
+    free(waits); free(holds); free(candidate); free(mark); free(cycle);
+    return NULL;
+}
+
+int watchdog_start(pthread_t *watchdog) {
+    waiting_for = calloc(N, sizeof(*waiting_for));
+    fork_holder = calloc(N, sizeof(*fork_holder));
+    wait_episode = calloc(N, sizeof(*wait_episode));
+    backoff_requested = calloc(N, sizeof(*backoff_requested));
+    if (!waiting_for || !fork_holder || !wait_episode || !backoff_requested ||
+        pthread_create(watchdog, NULL, deadlock_watchdog, NULL) != 0) {
+        fprintf(stderr, "Error: Failed to start deadlock watchdog.\n");
+        free(waiting_for); free(fork_holder); free(wait_episode); free(backoff_requested);
+        return 1;
+    }
+    return 0;
+}
+
+void watchdog_finish(pthread_t watchdog) {
+    atomic_store(&watchdog_stop, 1);
+    pthread_join(watchdog, NULL);
+    fprintf(stderr, "Deadlock watchdog: %lu scans, %.1f us per scan, %lu deadlocks\n",
+            watchdog_scans, watchdog_scans ? watchdog_scan_ns / 1e3 / watchdog_scans : 0.0, deadlocks_found);
+    free(waiting_for); free(fork_holder); free(wait_episode); free(backoff_requested);
+}
+
+void pick_up_forks(int id, int left_fork, int right_fork) {
+    switch (strategy) {
+        case STRATEGY_WAITER:
+            while (1) {
+                if (use_synchronization) {
+                    sem_wait(&mutex);
+                }
+
+                int waited_fork = left_fork;
+                if (take_fork(id, left_fork, EVENT_PICK_LEFT) == 0) {
+                    if (take_fork(id, right_fork, EVENT_PICK_RIGHT) == 0) {
+                        break;
+                    }
+                    // Asked to break a deadlock: give the left fork back and retry later.
+                    waited_fork = right_fork;
+                    trace_event(id, EVENT_BACKOFF, waited_fork);
+                    drop_fork(id, left_fork, EVENT_PUT_LEFT);
+                } else {
+                    trace_event(id, EVENT_BACKOFF, waited_fork);
+                }
+                if (use_synchronization) {
+                    sem_post(&mutex);
+                }
+                atomic_store(&backoff_requested[id], 0);
+                usleep(random_below(1000));
+            }
+
+            if (use_synchronization) {
+                sem_post(&mutex);
+            }
+            break;
+
+        case STRATEGY_ORDERED:
+            if (left_fork < right_fork) {
+                take_fork(id, left_fork, EVENT_PICK_LEFT);
+                take_fork(id, right_fork, EVENT_PICK_RIGHT);
+            } else {
+                take_fork(id, right_fork, EVENT_PICK_RIGHT);
+                take_fork(id, left_fork, EVENT_PICK_LEFT);
+            }
+            break;
+
+        case STRATEGY_CHANDY:
+            chandy_pick_up(id, left_fork, right_fork);
+            trace_event(id, EVENT_PICK_LEFT, left_fork);
+            trace_event(id, EVENT_PICK_RIGHT, right_fork);
+            break;
+    }
+}
+
+void put_down_forks(int id, int left_fork, int right_fork) {
+    if (strategy == STRATEGY_CHANDY) {
+        chandy_put_down(id, left_fork, right_fork);
+        trace_event(id, EVENT_PUT_LEFT, left_fork);
+        trace_event(id, EVENT_PUT_RIGHT, right_fork);
+        return;
+    }
+
+    drop_fork(id, left_fork, EVENT_PUT_LEFT);
+    drop_fork(id, right_fork, EVENT_PUT_RIGHT);
+}
 
 
 void* dining_person(void* num) {
@@ -19,49 +925,775 @@ void* dining_person(void* num) {
     int right_fork = (id + 1) % N;
     int meals_eaten = 0;
 
-    while (meals_eaten < meals_count) {
-        printf("Philosopher %d is thinking... (meals left: %d)\n", id + 1, meals_count - meals_eaten);
-        usleep((rand() % 500 + 100) * 1000); 
+    pcg32_init(&thread_rng, rng_seed, (uint64_t)id);
+    if (bench_mode) {
+        pthread_barrier_wait(&start_barrier);
+    }
+
+    while (bench_mode ? !atomic_load_explicit(&stop_dining, memory_order_relaxed) : meals_eaten < meals_count) {
+        trace_event(id, EVENT_THINK, meals_eaten);
+        if (!bench_mode) {
+            usleep((random_below(500) + 100) * 1000);
+        }
+
+        uint64_t hungry_since = now_ns();
+        pick_up_forks(id, left_fork, right_fork);
+        hist_record(&wait_histograms[id], now_ns() - hungry_since);
 
-        if (use_synchronization) {
-            sem_wait(&mutex);  
+        trace_event(id, EVENT_EAT, meals_eaten);
+        if (!bench_mode) {
+            usleep((random_below(500) + 200) * 1000);
         }
+        meals_eaten++;
 
-        sem_wait(&forks[left_fork]);
-        printf("Philosopher %d picked up left fork %d\n", id + 1, left_fork + 1);
+        put_down_forks(id, left_fork, right_fork);
+    }
 
-        
-        sem_wait(&forks[right_fork]);
-        printf("Philosopher %d picked up right fork %d\n", id + 1, right_fork + 1);
+    meals_done[id] = meals_eaten;
+    trace_event(id, EVENT_DONE, meals_eaten);
+    return NULL;
+}
 
-        if (use_synchronization) {
-            sem_post(&mutex);  
+void print_json_report(FILE *out, const char *mode, const char *label, double elapsed,
+                       latency_histogram *all, latency_histogram *per_philosopher) {
+    double total = 0, squares = 0;
+    long min_meals = LONG_MAX, max_meals = 0, starved = 0;
+    for (int i = 0; i < N; i++) {
+        total += meals_done[i];
+        squares += (double)meals_done[i] * meals_done[i];
+        if (meals_done[i] < min_meals) min_meals = meals_done[i];
+        if (meals_done[i] > max_meals) max_meals = meals_done[i];
+        if (meals_done[i] == 0) starved++;
+    }
+    uint64_t count = atomic_load(&all->count);
+
+    int uses_forks = strcmp(mode, "threads") == 0 && strategy != STRATEGY_CHANDY;
+    fprintf(out, "{\"mode\": \"%s\", \"strategy\": \"%s\", \"fork\": \"%s\", \"cpus\": %d, "
+            "\"n\": %d, \"seed\": %llu, "
+            "\"elapsed_s\": %.6f, \"meals\": %.0f, \"meals_per_sec\": %.2f, "
+            "\"jain\": %.6f, \"min_meals\": %ld, \"max_meals\": %ld, \"starved\": %ld, ",
+            mode, label, uses_forks ? fork_kind_names[fork_kind] : "none", bench_cpus,
+            N, (unsigned long long)rng_seed, elapsed, total, total / elapsed,
+            squares > 0 ? total * total / (N * squares) : 0, min_meals, max_meals, starved);
+    fprintf(out, "\"wait_ns\": {\"count\": %llu, \"mean\": %.0f, \"p50\": %llu, \"p90\": %llu, "
+            "\"p99\": %llu, \"p999\": %llu, \"max\": %llu}",
+            (unsigned long long)count, count ? (double)atomic_load(&all->sum) / count : 0.0,
+            (unsigned long long)hist_percentile(all, 0.5), (unsigned long long)hist_percentile(all, 0.9),
+            (unsigned long long)hist_percentile(all, 0.99), (unsigned long long)hist_percentile(all, 0.999),
+            (unsigned long long)atomic_load(&all->max));
+    if (per_philosopher) {
+        fprintf(out, ", \"philosophers\": [");
+        for (int i = 0; i < N; i++) {
+            fprintf(out, "%s{\"id\": %d, \"meals\": %ld, \"p50\": %llu, \"p99\": %llu, \"max\": %llu}",
+                    i ? ", " : "", i + 1, meals_done[i],
+                    (unsigned long long)hist_percentile(&per_philosopher[i], 0.5),
+                    (unsigned long long)hist_percentile(&per_philosopher[i], 0.99),
+                    (unsigned long long)atomic_load(&per_philosopher[i].max));
         }
+        fprintf(out, "]");
+    }
+    fprintf(out, "}\n");
+}
 
-        printf("Philosopher %d is eating... (meals left: %d)\n", id + 1, meals_count - meals_eaten - 1);
-        usleep((rand() % 500 + 200) * 1000); 
-        meals_eaten++;
+// histograms: either one per philosopher (per_philosopher set) or any number
+// of partial histograms (one per worker, one for the simulation).
+void print_bench_report(const char *mode, const char *label, double elapsed,
+                        latency_histogram *histograms, int histogram_count, int per_philosopher) {
+    double total = 0, squares = 0;
+    long min_meals = LONG_MAX, max_meals = 0;
+    for (int i = 0; i < N; i++) {
+        total += meals_done[i];
+        squares += (double)meals_done[i] * meals_done[i];
+        if (meals_done[i] < min_meals) min_meals = meals_done[i];
+        if (meals_done[i] > max_meals) max_meals = meals_done[i];
+    }
+    // Jain's index: 1.0 when every philosopher ate equally, 1/N when one ate everything.
+    double fairness = squares > 0 ? total * total / (N * squares) : 0;
+
+    latency_histogram *all = hist_alloc(1);
+    if (!all) {
+        fprintf(stderr, "Error: Failed to allocate memory for the report.\n");
+        return;
+    }
+    for (int i = 0; i < histogram_count; i++) {
+        hist_merge(all, &histograms[i]);
+    }
+
+    printf("Strategy: %s, N = %d, time = %.3f s\n", label, N, elapsed);
+    printf("Meals: %.0f (%.0f meals/sec)\n", total, total / elapsed);
+    printf("Meals per philosopher: min %ld, max %ld, fairness (Jain) %.4f\n", min_meals, max_meals, fairness);
+    char p50[32], p99[32], max[32];
+    printf("Wait to eat: p50 %s, p99 %s, max %s\n",
+           format_duration(hist_percentile(all, 0.5), p50, sizeof(p50)),
+           format_duration(hist_percentile(all, 0.99), p99, sizeof(p99)),
+           format_duration(atomic_load(&all->max), max, sizeof(max)));
+
+    if (json_path) {
+        FILE *out = strcmp(json_path, "-") == 0 ? stdout : fopen(json_path, "a");
+        if (!out) {
+            fprintf(stderr, "Error: cannot open %s\n", json_path);
+        } else {
+            print_json_report(out, mode, label, elapsed, all, per_philosopher ? histograms : NULL);
+            if (out != stdout) fclose(out);
+        }
+    }
+    free(all);
+}
+
+// M:N mode: philosophers are small state machines run by a fixed pool of
+// workers instead of one thread each. A task never blocks: when a fork is
+// taken it parks itself on that fork and the neighbour that releases it
+// pushes the task onto its own deque. Forks are taken in resource order.
+// Idle workers steal from the other deques.
+#define FORK_HELD   1u
+#define FORK_WAITER 2u
+
+enum task_step {
+    TASK_FIRST_FORK,
+    TASK_SECOND_FORK
+};
+
+typedef struct {
+    _Atomic uint32_t state;  // FORK_HELD | FORK_WAITER
+    int32_t waiter;          // only the other neighbour can ever wait here
+} task_fork;
+
+typedef struct {
+    alignas(64) pthread_mutex_t lock;
+    int32_t *items;          // ring buffer, owner works at the bottom
+    size_t top;
+    size_t bottom;
+    size_t capacity;
+    unsigned long steals;
+} task_deque;
+
+int task_workers = 0;
+task_fork *task_forks;
+uint8_t *task_steps;
+uint64_t *task_hungry_since;
+latency_histogram *worker_histograms;
+task_deque *task_deques;
+atomic_long tasks_finished;
+
+int deque_grow(task_deque *deque) {
+    size_t capacity = deque->capacity * 2;
+    int32_t *items = malloc(capacity * sizeof(int32_t));
+    if (!items) {
+        return 1;
+    }
+    size_t count = deque->bottom - deque->top;
+    for (size_t i = 0; i < count; i++) {
+        items[i] = deque->items[(deque->top + i) % deque->capacity];
+    }
+    free(deque->items);
+    deque->items = items;
+    deque->top = 0;
+    deque->bottom = count;
+    deque->capacity = capacity;
+    return 0;
+}
+
+// at_top: the task goes behind everything else (a philosopher that just ate).
+void deque_push(task_deque *deque, int32_t task, int at_top) {
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom - deque->top == deque->capacity && deque_grow(deque) != 0) {
+        fprintf(stderr, "Error: task deque is out of memory.\n");
+        exit(1);
+    }
+    if (at_top) {
+        // Shifting both indices by the capacity keeps every slot in place.
+        if (deque->top == 0) {
+            deque->top += deque->capacity;
+            deque->bottom += deque->capacity;
+        }
+        deque->items[--deque->top % deque->capacity] = task;
+    } else {
+        deque->items[deque->bottom++ % deque->capacity] = task;
+    }
+    pthread_mutex_unlock(&deque->lock);
+}
+
+int32_t deque_pop(task_deque *deque, int from_top) {
+    int32_t task = -1;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom != deque->top) {
+        if (from_top) {
+            task = deque->items[deque->top++ % deque->capacity];
+        } else {
+            task = deque->items[--deque->bottom % deque->capacity];
+        }
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return task;
+}
+
+// Returns 1 when the fork was taken, 0 when the task parked on it.
+int task_fork_take(int fork_id, int id) {
+    task_fork *fork = &task_forks[fork_id];
+    while (1) {
+        uint32_t expected = 0;
+        if (atomic_compare_exchange_weak(&fork->state, &expected, FORK_HELD)) {
+            return 1;
+        }
+        if (expected == FORK_HELD) {
+            fork->waiter = id;  // published by the CAS below
+            if (atomic_compare_exchange_weak(&fork->state, &expected, FORK_HELD | FORK_WAITER)) {
+                return 0;
+            }
+        }
+    }
+}
+
+void task_fork_release(int fork_id, task_deque *own) {
+    task_fork *fork = &task_forks[fork_id];
+    if (atomic_exchange(&fork->state, 0) & FORK_WAITER) {
+        deque_push(own, fork->waiter, 0);
+    }
+}
+
+void run_task(int id, task_deque *own, latency_histogram *histogram) {
+    int left_fork = id;
+    int right_fork = (id + 1) % N;
+    int first = left_fork < right_fork ? left_fork : right_fork;
+    int second = left_fork < right_fork ? right_fork : left_fork;
+
+    if (task_steps[id] == TASK_FIRST_FORK) {
+        if (task_hungry_since[id] == 0) {
+            task_hungry_since[id] = now_ns();
+        }
+        if (!task_fork_take(first, id)) {
+            return;
+        }
+        task_steps[id] = TASK_SECOND_FORK;
+    }
+    if (!task_fork_take(second, id)) {
+        return;
+    }
+
+    hist_record(histogram, now_ns() - task_hungry_since[id]);
+    task_hungry_since[id] = 0;
+    meals_done[id]++;
+    task_fork_release(second, own);
+    task_fork_release(first, own);
+    task_steps[id] = TASK_FIRST_FORK;
 
-        sem_post(&forks[left_fork]);
-        printf("Philosopher %d put down left fork %d\n", id + 1, left_fork + 1);
-        sem_post(&forks[right_fork]);
-        printf("Philosopher %d put down right fork %d\n", id + 1, right_fork + 1);
+    int finished = bench_mode ? atomic_load_explicit(&stop_dining, memory_order_relaxed)
+                              : meals_done[id] >= meals_count;
+    if (finished) {
+        atomic_fetch_add(&tasks_finished, 1);
+    } else {
+        deque_push(own, id, 1);
     }
+}
+
+void* task_worker(void *arg) {
+    int worker = (int)(intptr_t)arg;
+    task_deque *own = &task_deques[worker];
+    pcg32_init(&thread_rng, rng_seed, (uint64_t)worker);
 
-    printf("Philosopher %d has finished dining.\n", id + 1);
+    pthread_barrier_wait(&start_barrier);
+    while (atomic_load_explicit(&tasks_finished, memory_order_relaxed) < N) {
+        int32_t task = deque_pop(own, 0);
+        if (task < 0 && task_workers > 1) {
+            int victim = (int)random_below((uint32_t)task_workers);
+            if (victim != worker) {
+                task = deque_pop(&task_deques[victim], 1);
+                if (task >= 0) {
+                    own->steals++;
+                }
+            }
+        }
+        if (task < 0) {
+            sched_yield();
+            continue;
+        }
+        run_task(task, own, &worker_histograms[worker]);
+    }
     return NULL;
 }
 
+int run_task_mode() {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (task_workers <= 0) {
+        task_workers = cpus > 0 ? (int)cpus : 1;
+    }
+    printf("Running %d philosophers as tasks on %d workers.\n", N, task_workers);
+
+    task_forks = calloc(N, sizeof(task_fork));
+    task_steps = calloc(N, sizeof(uint8_t));
+    task_hungry_since = calloc(N, sizeof(uint64_t));
+    worker_histograms = hist_alloc(task_workers);
+    meals_done = calloc(N, sizeof(long));
+    task_deques = NULL;
+    pthread_t *workers = malloc(task_workers * sizeof(pthread_t));
+    if (posix_memalign((void **)&task_deques, 64, task_workers * sizeof(task_deque)) != 0 ||
+        !task_forks || !task_steps || !task_hungry_since || !worker_histograms || !meals_done || !workers) {
+        fprintf(stderr, "Error: Failed to allocate memory for tasks.\n");
+        return 1;
+    }
+
+    // Neighbours share forks, so each worker starts with a contiguous block.
+    for (int w = 0; w < task_workers; w++) {
+        task_deque *deque = &task_deques[w];
+        int from = (int)((long)N * w / task_workers);
+        int to = (int)((long)N * (w + 1) / task_workers);
+        pthread_mutex_init(&deque->lock, NULL);
+        deque->capacity = (size_t)(to - from) + 16;
+        deque->items = malloc(deque->capacity * sizeof(int32_t));
+        if (!deque->items) {
+            fprintf(stderr, "Error: Failed to allocate memory for tasks.\n");
+            return 1;
+        }
+        deque->top = 0;
+        deque->bottom = 0;
+        deque->steals = 0;
+        for (int id = to - 1; id >= from; id--) {
+            deque->items[deque->bottom++] = id;
+        }
+    }
+
+    pthread_barrier_init(&start_barrier, NULL, task_workers + 1);
+    for (int w = 0; w < task_workers; w++) {
+        if (pthread_create(&workers[w], NULL, task_worker, (void *)(intptr_t)w) != 0) {
+            fprintf(stderr, "Error: Failed to create worker %d.\n", w);
+            exit(1);
+        }
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_barrier_wait(&start_barrier);
+    if (bench_mode) {
+        usleep(bench_duration_ms * 1000);
+        atomic_store(&stop_dining, 1);
+    }
+    for (int w = 0; w < task_workers; w++) {
+        pthread_join(workers[w], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    unsigned long steals = 0;
+    for (int w = 0; w < task_workers; w++) {
+        steals += task_deques[w].steals;
+        pthread_mutex_destroy(&task_deques[w].lock);
+        free(task_deques[w].items);
+    }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    print_bench_report("tasks", "ordered", (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9,
+                       worker_histograms, task_workers, 0);
+    printf("Workers: %d, steals: %lu, max RSS: %ld KB\n", task_workers, steals, usage.ru_maxrss);
+
+    pthread_barrier_destroy(&start_barrier);
+    free(task_forks);
+    free(task_steps);
+    free(task_hungry_since);
+    free(worker_histograms);
+    free(task_deques);
+    free(meals_done);
+    free(workers);
+    return 0;
+}
+
+// Discrete-event simulation: the same acquisition policies and the same
+// think/eat distributions, but time is virtual (microseconds) and a single
+// thread advances it from a heap of timed events. Blocking is modelled with
+// wait slots and a FIFO seat queue; philosophers that get unblocked go onto
+// a ready stack instead of being advanced recursively.
+enum sim_event_type {
+    SIM_HUNGRY,
+    SIM_REACHED,        // the pickup delay between the two forks is over
+    SIM_DONE_EATING
+};
+
+typedef struct {
+    uint64_t time;
+    uint64_t seq;           // ties are broken in scheduling order
+    int32_t philosopher;
+    int32_t type;
+} sim_event;
+
+typedef struct {
+    int32_t holder;         // -1 when free; the owner for Chandy-Misra
+    int32_t waiter;         // blocked neighbour or pending request, -1 if none
+    int32_t dirty;
+} sim_fork;
+
+typedef struct {
+    pcg32 rng;
+    uint64_t hungry_since;
+    int32_t step;           // progress through the acquisition policy
+    int32_t hungry;
+    int32_t eating;
+    int32_t next_in_queue;  // seat queue link
+} sim_philosopher;
+
+int sim_mode = 0;
+uint64_t sim_pickup_us = 0;
+sim_event *sim_heap;
+size_t sim_heap_size;
+uint64_t sim_seq;
+uint64_t sim_now;
+sim_fork *sim_forks;
+sim_philosopher *sim_people;
+latency_histogram *sim_histogram;
+int32_t *sim_ready;
+size_t sim_ready_count;
+long sim_seats;
+int32_t seat_queue_head = -1;
+int32_t seat_queue_tail = -1;
+
+int sim_event_before(const sim_event *a, const sim_event *b) {
+    return a->time < b->time || (a->time == b->time && a->seq < b->seq);
+}
+
+// Every philosopher has at most one pending event, so the heap never exceeds N.
+void sim_schedule(int p, int type, uint64_t delay) {
+    size_t i = sim_heap_size++;
+    sim_event event = {sim_now + delay, sim_seq++, p, type};
+    while (i > 0 && sim_event_before(&event, &sim_heap[(i - 1) / 2])) {
+        sim_heap[i] = sim_heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    sim_heap[i] = event;
+}
+
+sim_event sim_pop() {
+    sim_event top = sim_heap[0];
+    sim_event last = sim_heap[--sim_heap_size];
+    size_t i = 0;
+    while (1) {
+        size_t child = 2 * i + 1;
+        if (child >= sim_heap_size) break;
+        if (child + 1 < sim_heap_size && sim_event_before(&sim_heap[child + 1], &sim_heap[child])) child++;
+        if (!sim_event_before(&sim_heap[child], &last)) break;
+        sim_heap[i] = sim_heap[child];
+        i = child;
+    }
+    sim_heap[i] = last;
+    return top;
+}
+
+void sim_wake(int p) {
+    sim_ready[sim_ready_count++] = p;
+}
+
+int sim_take_fork(int fork_id, int p) {
+    if (sim_forks[fork_id].holder < 0) {
+        sim_forks[fork_id].holder = p;
+        return 1;
+    }
+    sim_forks[fork_id].waiter = p;
+    return 0;
+}
+
+void sim_release_fork(int fork_id) {
+    sim_fork *fork = &sim_forks[fork_id];
+    fork->holder = -1;
+    if (fork->waiter >= 0) {
+        sim_wake(fork->waiter);
+        fork->waiter = -1;
+    }
+}
+
+void sim_chandy_transfer(int fork_id, int to) {
+    sim_fork *fork = &sim_forks[fork_id];
+    int from = fork->holder;
+    fork->holder = to;
+    fork->dirty = 0;
+    fork->waiter = sim_people[from].hungry ? from : -1;
+}
+
+void sim_start_eating(int p) {
+    sim_philosopher *person = &sim_people[p];
+    hist_record(sim_histogram, (sim_now - person->hungry_since) * 1000);
+    person->hungry = 0;
+    person->eating = 1;
+    sim_schedule(p, SIM_DONE_EATING, (pcg32_below(&person->rng, 500) + 200) * 1000ULL);
+}
+
+void sim_advance(int p) {
+    sim_philosopher *person = &sim_people[p];
+    int left_fork = p;
+    int right_fork = (p + 1) % N;
+    int first = left_fork < right_fork ? left_fork : right_fork;
+    int second = left_fork < right_fork ? right_fork : left_fork;
+
+    switch (strategy) {
+        case STRATEGY_WAITER:
+            if (person->step == 0) {
+                if (use_synchronization) {
+                    if (sim_seats == 0) {
+                        person->next_in_queue = -1;
+                        if (seat_queue_tail >= 0) sim_people[seat_queue_tail].next_in_queue = p;
+                        else seat_queue_head = p;
+                        seat_queue_tail = p;
+                        return;
+                    }
+                    sim_seats--;
+                }
+                person->step = 1;
+            }
+            if (person->step == 1) {
+                if (!sim_take_fork(left_fork, p)) return;
+                person->step = 2;
+                if (sim_pickup_us) {
+                    sim_schedule(p, SIM_REACHED, sim_pickup_us);
+                    return;
+                }
+            }
+            if (!sim_take_fork(right_fork, p)) return;
+            if (use_synchronization) {
+                // The seat goes straight to the first philosopher in the queue.
+                if (seat_queue_head >= 0) {
+                    int next = seat_queue_head;
+                    seat_queue_head = sim_people[next].next_in_queue;
+                    if (seat_queue_head < 0) seat_queue_tail = -1;
+                    sim_people[next].step = 1;
+                    sim_wake(next);
+                } else {
+                    sim_seats++;
+                }
+            }
+            break;
+
+        case STRATEGY_ORDERED:
+            if (person->step == 0) {
+                if (!sim_take_fork(first, p)) return;
+                person->step = 1;
+                if (sim_pickup_us) {
+                    sim_schedule(p, SIM_REACHED, sim_pickup_us);
+                    return;
+                }
+            }
+            if (!sim_take_fork(second, p)) return;
+            break;
+
+        case STRATEGY_CHANDY: {
+            int wanted[2] = {left_fork, right_fork};
+            for (int i = 0; i < 2; i++) {
+                sim_fork *fork = &sim_forks[wanted[i]];
+                if (fork->holder == p) continue;
+                if (fork->dirty && !sim_people[fork->holder].eating) {
+                    sim_chandy_transfer(wanted[i], p);
+                } else {
+                    fork->waiter = p;
+                }
+            }
+            if (sim_forks[left_fork].holder != p || sim_forks[right_fork].holder != p) return;
+            break;
+        }
+    }
+    sim_start_eating(p);
+}
+
+void sim_done_eating(int p) {
+    sim_philosopher *person = &sim_people[p];
+    int left_fork = p;
+    int right_fork = (p + 1) % N;
+
+    person->eating = 0;
+    meals_done[p]++;
+    if (strategy == STRATEGY_CHANDY) {
+        int used[2] = {left_fork, right_fork};
+        for (int i = 0; i < 2; i++) {
+            sim_fork *fork = &sim_forks[used[i]];
+            fork->dirty = 1;
+            if (fork->waiter >= 0 && fork->waiter != p) {
+                int next = fork->waiter;
+                sim_chandy_transfer(used[i], next);
+                sim_wake(next);
+            }
+        }
+    } else {
+        sim_release_fork(left_fork);
+        sim_release_fork(right_fork);
+    }
+
+    if (meals_done[p] < meals_count) {
+        sim_schedule(p, SIM_HUNGRY, (pcg32_below(&person->rng, 500) + 100) * 1000ULL);
+    }
+}
+
+int run_simulation() {
+    sim_heap = malloc(N * sizeof(sim_event));
+    sim_forks = malloc(N * sizeof(sim_fork));
+    sim_people = calloc(N, sizeof(sim_philosopher));
+    sim_ready = malloc(2 * (size_t)N * sizeof(int32_t));
+    meals_done = calloc(N, sizeof(long));
+    sim_histogram = hist_alloc(1);
+    if (!sim_heap || !sim_forks || !sim_people || !sim_ready || !meals_done || !sim_histogram) {
+        fprintf(stderr, "Error: Failed to allocate memory for the simulation.\n");
+        return 1;
+    }
+
+    struct timespec wall_start, wall_end;
+    clock_gettime(CLOCK_MONOTONIC, &wall_start);
+
+    sim_seats = N - 1;
+    for (int i = 0; i < N; i++) {
+        int neighbour = (i + N - 1) % N;
+        sim_forks[i].holder = strategy == STRATEGY_CHANDY ? (neighbour < i ? neighbour : i) : -1;
+        sim_forks[i].waiter = -1;
+        sim_forks[i].dirty = 1;
+        pcg32_init(&sim_people[i].rng, rng_seed, (uint64_t)i);
+        sim_schedule(i, SIM_HUNGRY, (pcg32_below(&sim_people[i].rng, 500) + 100) * 1000ULL);
+    }
+
+    unsigned long events = 0;
+    while (sim_heap_size > 0) {
+        sim_event event = sim_pop();
+        sim_now = event.time;
+        events++;
+        if (event.type == SIM_HUNGRY) {
+            sim_philosopher *person = &sim_people[event.philosopher];
+            person->hungry = 1;
+            person->hungry_since = sim_now;
+            person->step = 0;
+            sim_advance(event.philosopher);
+        } else if (event.type == SIM_REACHED) {
+            sim_advance(event.philosopher);
+        } else {
+            sim_done_eating(event.philosopher);
+        }
+        while (sim_ready_count > 0) {
+            sim_advance(sim_ready[--sim_ready_count]);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &wall_end);
+
+    long total_meals = 0;
+    for (int i = 0; i < N; i++) {
+        total_meals += meals_done[i];
+    }
+
+    print_bench_report("sim", use_synchronization ? strategy_names[strategy] : "nosync", sim_now / 1e6,
+                       sim_histogram, 1, 0);
+    printf("Events: %lu, wall time %.3f ms\n", events,
+           (wall_end.tv_sec - wall_start.tv_sec) * 1e3 + (wall_end.tv_nsec - wall_start.tv_nsec) / 1e6);
+
+    int deadlocked = total_meals < (long)N * meals_count;
+    if (deadlocked) {
+        printf("Deadlock at %.3f s of virtual time: %ld of %ld meals eaten\n",
+               sim_now / 1e6, total_meals, (long)N * meals_count);
+    }
+
+    free(sim_heap);
+    free(sim_forks);
+    free(sim_people);
+    free(sim_ready);
+    free(sim_histogram);
+    free(meals_done);
+    return deadlocked ? 2 : 0;
+}
+
+int parse_option(const char *arg) {
+    if (strcmp(arg, "nosync") == 0) {
+        use_synchronization = 0;
+    } else if (strncmp(arg, "--strategy=", 11) == 0) {
+        int found = 0;
+        for (int s = 0; s < 3; s++) {
+            if (strcmp(arg + 11, strategy_names[s]) == 0) {
+                strategy = (enum strategy)s;
+                found = 1;
+            }
+        }
+        if (!found) return 1;
+    } else if (strcmp(arg, "--tasks") == 0) {
+        task_workers = -1;
+    } else if (strncmp(arg, "--tasks=", 8) == 0) {
+        task_workers = atoi(arg + 8);
+        if (task_workers <= 0) return 1;
+    } else if (strncmp(arg, "--seed=", 7) == 0) {
+        char *endptr;
+        rng_seed = strtoull(arg + 7, &endptr, 10);
+        if (*endptr != '\0' || endptr == arg + 7) return 1;
+    } else if (strcmp(arg, "--sim") == 0) {
+        sim_mode = 1;
+    } else if (strncmp(arg, "--pickup=", 9) == 0) {
+        sim_pickup_us = strtoull(arg + 9, NULL, 10);
+    } else if (strncmp(arg, "--fork=", 7) == 0) {
+        int found = 0;
+        for (int k = 0; k < 4; k++) {
+            if (strcmp(arg + 7, fork_kind_names[k]) == 0) {
+                fork_kind = (enum fork_kind)k;
+                found = 1;
+            }
+        }
+        if (!found) return 1;
+    } else if (strncmp(arg, "--cpus=", 7) == 0) {
+        bench_cpus = atoi(arg + 7);
+        if (bench_cpus <= 0 || bench_cpus > CPU_SETSIZE) return 1;
+    } else if (strcmp(arg, "--bench") == 0) {
+        bench_mode = 1;
+    } else if (strncmp(arg, "--duration=", 11) == 0) {
+        bench_duration_ms = atoi(arg + 11);
+        if (bench_duration_ms <= 0) return 1;
+    } else if (strncmp(arg, "--trace=", 8) == 0) {
+        trace_path = arg + 8;
+    } else if (strcmp(arg, "--detect") == 0) {
+        detect_deadlocks = 1;
+    } else if (strcmp(arg, "--no-detect") == 0) {
+        detect_deadlocks = 0;
+    } else if (strcmp(arg, "--break-deadlock") == 0) {
+        break_deadlocks = 1;
+    } else if (strncmp(arg, "--detect-interval=", 18) == 0) {
+        detect_interval_us = atoi(arg + 18);
+        if (detect_interval_us <= 0) return 1;
+    } else if (strcmp(arg, "--json") == 0) {
+        json_path = "-";
+    } else if (strncmp(arg, "--json=", 7) == 0) {
+        json_path = arg + 7;
+    } else if (strcmp(arg, "--quiet") == 0) {
+        trace_text = 0;
+    } else if (strncmp(arg, "--meals=", 8) == 0) {
+        meals_count = atoi(arg + 8);
+        if (meals_count <= 0) return 1;
+    } else {
+        return 1;
+    }
+    return 0;
+}
+
+void print_usage(const char *program) {
+    fprintf(stderr, "Usage: %s <N> [nosync] [options]\n", program);
+    fprintf(stderr, "  <N> - number of philosophers\n");
+    fprintf(stderr, "  nosync - disable synchronization to demonstrate deadlock\n");
+    fprintf(stderr, "  --strategy=waiter|ordered|chandy - fork acquisition strategy (default waiter)\n");
+    fprintf(stderr, "  --meals=K - meals per philosopher (default 10)\n");
+    fprintf(stderr, "  --bench - no sleeps and no per-event output, report throughput and fairness\n");
+    fprintf(stderr, "  --duration=MS - length of a benchmark run (default 1000)\n");
+    fprintf(stderr, "  --fork=sem|mutex|futex|spin - fork primitive for waiter/ordered (default sem)\n");
+    fprintf(stderr, "  --cpus=K - run the philosopher threads on the first K CPUs only\n");
+    fprintf(stderr, "  --seed=S - seed for think/eat times (default: current time)\n");
+    fprintf(stderr, "  --sim - discrete-event simulation in virtual time\n");
+    fprintf(stderr, "  --pickup=US - simulated time between taking the first and the second fork (default 0)\n");
+    fprintf(stderr, "  --tasks[=W] - run philosophers as tasks on W worker threads (default: one per CPU)\n");
+    fprintf(stderr, "  --json[=FILE] - append a JSON summary to FILE (default stdout)\n");
+    fprintf(stderr, "  --trace=FILE - write binary events to FILE\n");
+    fprintf(stderr, "  --quiet - do not print events\n");
+    fprintf(stderr, "  --detect / --no-detect - deadlock watchdog (default: on with nosync)\n");
+    fprintf(stderr, "  --detect-interval=US - watchdog scan interval (default 1000)\n");
+    fprintf(stderr, "  --break-deadlock - make one philosopher of a detected cycle back off\n");
+    fprintf(stderr, "Usage: %s --render <trace file>\n", program);
+}
+
 
 int main(int argc, char *argv[]) {
-    srand(time(NULL));
+    rng_seed = (uint64_t)time(NULL);
 
-    if (argc != 2 && argc != 3) {
-        fprintf(stderr, "Usage: %s <N> [nosync]\n", argv[0]);
-        fprintf(stderr, "  <N> - number of philosophers\n");
-        fprintf(stderr, "  nosync - disable synchronization to demonstrate deadlock\n");
+    if (argc < 2) {
+        print_usage(argv[0]);
         return 1;
     }
+    if (strcmp(argv[1], "--render") == 0) {
+        if (argc != 3) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        return render_trace_file(argv[2]);
+    }
 
     char *endptr;
     long N_long = strtol(argv[1], &endptr, 10);
@@ -71,17 +1703,91 @@ int main(int argc, char *argv[]) {
     }
     N = (int)N_long;
 
-    if (argc == 3 && strcmp(argv[2], "nosync") == 0) {
-        use_synchronization = 0;
+    for (int a = 2; a < argc; a++) {
+        if (parse_option(argv[a]) != 0) {
+            fprintf(stderr, "Error: unknown or invalid option %s\n", argv[a]);
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    printf("Seed: %llu\n", (unsigned long long)rng_seed);
+
+    if ((task_workers != 0 || sim_mode) && (fork_kind != FORK_SEM || bench_cpus != 0)) {
+        fprintf(stderr, "Error: --fork and --cpus only apply to philosopher threads\n");
+        return 1;
+    }
+
+    if (task_workers != 0) {
+        // Tasks have no sleeps, no events and cannot deadlock.
+        if (!use_synchronization || strategy != STRATEGY_WAITER || trace_path || detect_deadlocks > 0) {
+            fprintf(stderr, "Error: --tasks always uses resource ordering and supports no tracing or watchdog\n");
+            return 1;
+        }
+        return run_task_mode();
+    }
+
+    if (sim_mode) {
+        if (!use_synchronization && strategy != STRATEGY_WAITER) {
+            fprintf(stderr, "Error: nosync only applies to the waiter strategy\n");
+            return 1;
+        }
+        if (bench_mode || trace_path || detect_deadlocks > 0) {
+            fprintf(stderr, "Error: --sim runs in virtual time and supports no tracing or watchdog\n");
+            return 1;
+        }
+        return run_simulation();
+    }
+
+    if (bench_mode) {
+        trace_text = 0;
+    }
+    tracing = trace_text || trace_path != NULL;
+    if (detect_deadlocks < 0) {
+        detect_deadlocks = !use_synchronization;
+    }
+    if (break_deadlocks) {
+        detect_deadlocks = 1;
+    }
+    if (detect_deadlocks && strategy == STRATEGY_CHANDY) {
+        fprintf(stderr, "Error: the deadlock watchdog only supports semaphore forks\n");
+        return 1;
+    }
+    if (fork_kind != FORK_SEM && strategy == STRATEGY_CHANDY) {
+        fprintf(stderr, "Error: Chandy-Misra forks are always mutex + condition variable\n");
+        return 1;
+    }
+
+    if (!use_synchronization) {
+        if (strategy != STRATEGY_WAITER) {
+            fprintf(stderr, "Error: nosync only applies to the waiter strategy\n");
+            return 1;
+        }
         printf("Running without synchronization — deadlock possible!\n");
-    } else {
+    } else if (strategy == STRATEGY_WAITER) {
         printf("Running with synchronization (mutex = %d).\n", N - 1);
+    } else {
+        printf("Running with %s strategy.\n", strategy_names[strategy]);
+    }
+    if (fork_kind != FORK_SEM) {
+        printf("Forks: %s\n", fork_kind_names[fork_kind]);
     }
 
     // Allocate memory
-    forks = malloc(N * sizeof(sem_t));
-    if (!forks) {
+    if (posix_memalign((void **)&forks, 64, N * sizeof(padded_fork)) != 0) {
+        forks = NULL;
+    }
+    chandy_forks = malloc(N * sizeof(chandy_fork));
+    chandy_eating = calloc(N, sizeof(int));
+    meals_done = calloc(N, sizeof(long));
+    wait_histograms = hist_alloc(N);
+    if (!forks || !chandy_forks || !chandy_eating || !meals_done || !wait_histograms) {
         fprintf(stderr, "Error: Failed to allocate memory for forks.\n");
+        free(forks);
+        free(chandy_forks);
+        free(chandy_eating);
+        free(meals_done);
+        free(wait_histograms);
         return 1;
     }
 
@@ -90,17 +1796,21 @@ int main(int argc, char *argv[]) {
     if (!philosophers || !ids) {
         fprintf(stderr, "Error: Failed to allocate memory for threads.\n");
         free(forks);
+        free(chandy_forks);
+        free(chandy_eating);
+        free(meals_done);
+        free(wait_histograms);
         free(philosophers);
         free(ids);
         return 1;
     }
 
-    // Initialize semaphores with error tracking
+    // Initialize forks with error tracking
     int i;
     int success = 1;
     for (i = 0; i < N && success; i++) {
-        if (sem_init(&forks[i], 0, 1) != 0) {
-            fprintf(stderr, "Error: Failed to initialize semaphore %d.\n", i);
+        if (fork_init(&forks[i]) != 0) {
+            fprintf(stderr, "Error: Failed to initialize fork %d.\n", i);
             success = 0;
         }
     }
@@ -111,41 +1821,127 @@ int main(int argc, char *argv[]) {
     }
 
     if (!success) {
-        // Clean up initialized semaphores before exiting
+        // Clean up initialized forks before exiting
         for (int j = 0; j < i; j++) {
-            sem_destroy(&forks[j]);
+            fork_destroy(&forks[j]);
         }
         free(forks);
+        free(chandy_forks);
+        free(chandy_eating);
+        free(meals_done);
+        free(wait_histograms);
         free(philosophers);
         free(ids);
         return 1;
     }
 
+    // Fork f lies between philosophers f-1 and f; the lower id starts with it,
+    // which makes the initial precedence graph acyclic.
+    for (i = 0; i < N; i++) {
+        pthread_mutex_init(&chandy_forks[i].lock, NULL);
+        pthread_cond_init(&chandy_forks[i].cond, NULL);
+        int neighbour = (i + N - 1) % N;
+        chandy_forks[i].owner = neighbour < i ? neighbour : i;
+        chandy_forks[i].dirty = 1;
+    }
+
+    if (bench_mode) {
+        pthread_barrier_init(&start_barrier, NULL, N + 1);
+    }
+
+    pthread_t drainer;
+    if (tracing && trace_start(&drainer) != 0) {
+        success = 0;
+    }
+
+    pthread_t watchdog;
+    if (success && detect_deadlocks && watchdog_start(&watchdog) != 0) {
+        success = 0;
+    }
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, THREAD_STACK_SIZE);
+    if (bench_cpus > 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        for (int c = 0; c < bench_cpus; c++) {
+            CPU_SET(c, &cpus);
+        }
+        pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+    }
+
     // Create threads
+    int created = 0;
     for (i = 0; i < N && success; i++) {
         ids[i] = i;
-        if (pthread_create(&philosophers[i], NULL, dining_person, &ids[i]) != 0) {
+        if (pthread_create(&philosophers[i], &attr, dining_person, &ids[i]) != 0) {
             fprintf(stderr, "Error: Failed to create thread for philosopher %d.\n", i + 1);
             success = 0;
+        } else {
+            created++;
         }
     }
+    pthread_attr_destroy(&attr);
+
+    if (created > 0 && !success) {
+        // Threads already running (or waiting at the barrier) cannot be stopped.
+        fprintf(stderr, "Error: only %d threads were created.\n", created);
+        exit(1);
+    }
 
     if (success) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (bench_mode) {
+            pthread_barrier_wait(&start_barrier);
+        }
+        if (bench_mode) {
+            usleep(bench_duration_ms * 1000);
+            atomic_store(&stop_dining, 1);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+        }
+
         // Wait for threads to finish
         for (i = 0; i < N; i++) {
             pthread_join(philosophers[i], NULL);
         }
-        printf("All philosophers have finished dining.\n");
+        if (!bench_mode) {
+            clock_gettime(CLOCK_MONOTONIC, &end);
+        }
+        if (tracing) {
+            trace_finish(drainer);
+        }
+
+        if (!bench_mode) {
+            printf("All philosophers have finished dining.\n");
+        }
+        print_bench_report("threads", use_synchronization ? strategy_names[strategy] : "nosync",
+                           (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9,
+                           wait_histograms, N, 1);
+        fflush(stdout);
+        if (detect_deadlocks) {
+            watchdog_finish(watchdog);
+        }
     }
 
     // Free resources
     for (i = 0; i < N; i++) {
-        sem_destroy(&forks[i]);
+        fork_destroy(&forks[i]);
+        pthread_mutex_destroy(&chandy_forks[i].lock);
+        pthread_cond_destroy(&chandy_forks[i].cond);
     }
     sem_destroy(&mutex);
+    if (bench_mode) {
+        pthread_barrier_destroy(&start_barrier);
+    }
     free(forks);
+    free(chandy_forks);
+    free(chandy_eating);
+    free(meals_done);
+    free(wait_histograms);
     free(philosophers);
     free(ids);
 
     return success ? 0 : 1;
-}
\ No newline at end of file
+}
@@ -0,0 +1,297 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "gme.h"
+
+#define WORD_OCCUPANCY_MASK 0xffffffULL
+#define WORD_CLASS_SHIFT 24
+#define WORD_CLASS_MASK (0xffULL << WORD_CLASS_SHIFT)
+#define WORD_WAITER (1ULL << 32)
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int word_occupancy(uint64_t s) {
+    return (int)(s & WORD_OCCUPANCY_MASK);
+}
+
+// Class inside, -1 when empty.
+static int word_class(uint64_t s) {
+    return (int)((s & WORD_CLASS_MASK) >> WORD_CLASS_SHIFT) - 1;
+}
+
+static uint32_t word_waiters(uint64_t s) {
+    return (uint32_t)(s >> 32);
+}
+
+static uint64_t word_admitted(uint64_t s, int cls) {
+    return ((s & ~WORD_CLASS_MASK) | ((uint64_t)(cls + 1) << WORD_CLASS_SHIFT)) + 1;
+}
+
+static int fits(const gme *g, uint64_t s, int cls) {
+    int inside = word_class(s);
+    return (inside == -1 || inside == cls) && word_occupancy(s) < g->capacity[cls];
+}
+
+static gme_view make_view(const gme *g, uint64_t s) {
+    gme_view view = {
+        .classes = g->classes,
+        .inside = word_class(s),
+        .occupancy = word_occupancy(s),
+        .waiting = g->waiting,
+        .capacity = g->capacity
+    };
+    return view;
+}
+
+static void notify(gme *g, enum gme_event event, int cls, uint64_t s) {
+    if (g->observer) {
+        g->observer(g->observer_ctx, event, cls, word_class(s), word_occupancy(s));
+    }
+}
+
+// Called with the mutex held.
+static int admissible(gme *g, uint64_t s, int cls) {
+    if (!fits(g, s, cls)) {
+        return 0;
+    }
+    gme_view view = make_view(g, s);
+    return g->policy->may_enter(g->policy_ctx, &view, cls);
+}
+
+static void wake_all(gme *g) {
+    for (int k = 0; k < g->classes; k++) {
+        if (g->waiting[k] > 0) {
+            pthread_cond_broadcast(&g->conds[k]);
+        }
+    }
+}
+
+// Called with the mutex held after a leave that left queued threads behind.
+// The room may have changed since that leave, so wake whoever fits now.
+static void wake_after_leave(gme *g, int left) {
+    if (g->flags & GME_WAKE_ALL) {
+        wake_all(g);
+        return;
+    }
+    uint64_t s = atomic_load_explicit(&g->word, memory_order_relaxed);
+    int cls = word_class(s);
+    if (cls == -1) {
+        gme_view view = make_view(g, s);
+        cls = g->policy->next_class(g->policy_ctx, &view, left);
+    }
+    if (g->waiting[cls] > 0 && admissible(g, s, cls)) {
+        pthread_cond_signal(&g->conds[cls]);
+    }
+}
+
+void gme_enter(gme *g, int cls) {
+    uint64_t s = atomic_load_explicit(&g->word, memory_order_relaxed);
+    if (!(g->flags & GME_LOCK_ONLY)) {
+        while (word_waiters(s) == 0 && fits(g, s, cls)) {
+            if (atomic_compare_exchange_weak_explicit(&g->word, &s, word_admitted(s, cls),
+                                                      memory_order_acquire, memory_order_relaxed)) {
+                notify(g, GME_EVENT_ENTER, cls, word_admitted(s, cls));
+                return;
+            }
+        }
+    }
+
+    // Queue in the word before checking it: a leave that frees a slot after
+    // this point sees the waiter and takes the mutex to wake it.
+    pthread_mutex_lock(&g->mutex);
+    s = atomic_fetch_add_explicit(&g->word, WORD_WAITER, memory_order_relaxed) + WORD_WAITER;
+    int woken = 0;
+    for (;;) {
+        if (admissible(g, s, cls)) {
+            // Admission and dequeue in one step.
+            if (atomic_compare_exchange_weak_explicit(&g->word, &s, word_admitted(s, cls) - WORD_WAITER,
+                                                      memory_order_acquire, memory_order_relaxed)) {
+                break;
+            }
+            continue;
+        }
+        if (woken) {
+            g->futile_wakeups++;
+        }
+        notify(g, GME_EVENT_WAIT, cls, s);
+        g->waiting[cls]++;
+        pthread_cond_wait(&g->conds[cls], &g->mutex);
+        g->waiting[cls]--;
+        woken = 1;
+        s = atomic_load_explicit(&g->word, memory_order_relaxed);
+    }
+    s = word_admitted(s, cls) - WORD_WAITER;
+    gme_view view = make_view(g, s);
+    g->policy->admitted(g->policy_ctx, &view, cls);
+    notify(g, GME_EVENT_ENTER, cls, s);
+    if (g->flags & GME_WAKE_ALL) {
+        wake_all(g);
+    } else if (g->waiting[cls] > 0 && admissible(g, s, cls)) {
+        // Pass the wakeup along while this class still fits.
+        pthread_cond_signal(&g->conds[cls]);
+    }
+    pthread_mutex_unlock(&g->mutex);
+}
+
+void gme_leave(gme *g, int cls) {
+    int locked = g->flags & GME_LOCK_ONLY;
+    if (locked) {
+        pthread_mutex_lock(&g->mutex);
+    }
+    uint64_t s = atomic_load_explicit(&g->word, memory_order_relaxed);
+    uint64_t next;
+    do {
+        next = s - 1;
+        if (word_occupancy(next) == 0) {
+            next &= ~WORD_CLASS_MASK;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&g->word, &s, next,
+                                                    memory_order_release, memory_order_relaxed));
+    notify(g, GME_EVENT_LEAVE, cls, next);
+    if (word_waiters(next) == 0) {
+        if (locked) {
+            pthread_mutex_unlock(&g->mutex);
+        }
+        return;
+    }
+    if (!locked) {
+        pthread_mutex_lock(&g->mutex);
+    }
+    wake_after_leave(g, cls);
+    pthread_mutex_unlock(&g->mutex);
+}
+
+// Round-robin over the waiting classes, starting after the one that left.
+static int next_waiting_class(const gme_view *view, int left) {
+    for (int i = 1; i <= view->classes; i++) {
+        int cls = (left + i) % view->classes;
+        if (view->waiting[cls] > 0) {
+            return cls;
+        }
+    }
+    return left;
+}
+
+static int greedy_may_enter(void *ctx, const gme_view *view, int cls) {
+    (void)ctx;
+    (void)view;
+    (void)cls;
+    return 1;
+}
+
+static void greedy_admitted(void *ctx, const gme_view *view, int cls) {
+    (void)ctx;
+    (void)view;
+    (void)cls;
+}
+
+static int greedy_next_class(void *ctx, const gme_view *view, int left) {
+    (void)ctx;
+    return next_waiting_class(view, left);
+}
+
+const gme_policy gme_greedy = {greedy_may_enter, greedy_admitted, greedy_next_class};
+
+static int others_waiting(const gme_view *view, int cls) {
+    for (int k = 0; k < view->classes; k++) {
+        if (k != cls && view->waiting[k] > 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Only the class holding the room is ever held back, so an empty room is open
+// to whichever class the last leave woke. A phase starts at the first
+// slow-path admission of a class; fast-path admissions happen only while
+// nobody waits and do not count.
+static int phase_may_enter(void *ctx, const gme_view *view, int cls) {
+    gme_phase_state *state = ctx;
+    if (view->inside != cls || state->phase_class != cls || !others_waiting(view, cls)) {
+        return 1;
+    }
+    return state->admissions < state->batch &&
+           now_ns() - state->start_ns < (uint64_t)state->ms * 1000000ULL;
+}
+
+static void phase_admitted(void *ctx, const gme_view *view, int cls) {
+    gme_phase_state *state = ctx;
+    if (state->phase_class != cls || view->occupancy == 1) {
+        state->phase_class = cls;
+        state->admissions = 0;
+        state->start_ns = now_ns();
+    }
+    state->admissions++;
+}
+
+static int phase_next_class(void *ctx, const gme_view *view, int left) {
+    (void)ctx;
+    return next_waiting_class(view, left);
+}
+
+const gme_policy gme_phase = {phase_may_enter, phase_admitted, phase_next_class};
+
+void gme_phase_init(gme_phase_state *state, int batch, int ms) {
+    state->batch = batch;
+    state->ms = ms;
+    state->phase_class = -1;
+    state->admissions = 0;
+    state->start_ns = 0;
+}
+
+int gme_init(gme *g, const gme_config *config) {
+    if (config->classes < 1 || config->classes > GME_MAX_CLASSES) {
+        return -1;
+    }
+    for (int k = 0; k < config->classes; k++) {
+        if (config->capacity[k] < 1 || config->capacity[k] > GME_MAX_CAPACITY) {
+            return -1;
+        }
+    }
+    memset(g, 0, sizeof(*g));
+    g->classes = config->classes;
+    g->flags = config->flags;
+    g->policy = config->policy ? config->policy : &gme_greedy;
+    g->policy_ctx = config->policy_ctx;
+    g->observer = config->observer;
+    g->observer_ctx = config->observer_ctx;
+    atomic_init(&g->word, 0);
+
+    g->conds = malloc(sizeof(pthread_cond_t) * config->classes);
+    g->waiting = calloc(config->classes, sizeof(int));
+    g->capacity = malloc(sizeof(int) * config->classes);
+    if (!g->conds || !g->waiting || !g->capacity || pthread_mutex_init(&g->mutex, NULL) != 0) {
+        free(g->conds);
+        free(g->waiting);
+        free(g->capacity);
+        return -1;
+    }
+    memcpy(g->capacity, config->capacity, sizeof(int) * config->classes);
+    for (int k = 0; k < config->classes; k++) {
+        if (pthread_cond_init(&g->conds[k], NULL) != 0) {
+            while (k-- > 0) {
+                pthread_cond_destroy(&g->conds[k]);
+            }
+            pthread_mutex_destroy(&g->mutex);
+            free(g->conds);
+            free(g->waiting);
+            free(g->capacity);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void gme_destroy(gme *g) {
+    for (int k = 0; k < g->classes; k++) {
+        pthread_cond_destroy(&g->conds[k]);
+    }
+    pthread_mutex_destroy(&g->mutex);
+    free(g->conds);
+    free(g->waiting);
+    free(g->capacity);
+}
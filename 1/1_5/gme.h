@@ -0,0 +1,110 @@
+#ifndef GME_H
+#define GME_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+// Group mutual exclusion: a room shared by K classes of threads. Any number of
+// threads of one class (up to that class's capacity) may be inside at once,
+// but never two classes together. The bathroom in main.c is the K = 2 case.
+//
+// Programs using it are linked with gme.c (see the Build lines in main.c
+// and gme_bench.c).
+//
+// Synchronization: the room state lives in one 64-bit word, occupancy in bits
+// 0-23, class + 1 in bits 24-31 (0 when empty) and queued threads in bits
+// 32-63. While nobody is queued a thread enters or leaves with a single CAS.
+// Threads that must wait take the mutex and sleep on their class's condition
+// variable. They are woken one at a time, and each admitted thread passes
+// the wakeup on while its class still fits.
+
+#define GME_MAX_CLASSES 254
+#define GME_MAX_CAPACITY 0xffffff
+
+// Flags for gme_config.flags.
+#define GME_LOCK_ONLY 1     // every enter and leave takes the mutex
+#define GME_WAKE_ALL 2      // broadcast to every class instead of targeted signals
+
+enum gme_event {
+    GME_EVENT_WAIT,
+    GME_EVENT_ENTER,
+    GME_EVENT_LEAVE
+};
+
+// What policies and observers see. inside is -1 when the room is empty.
+typedef struct {
+    int classes;
+    int inside;
+    int occupancy;
+    const int *waiting;     // per class, threads asleep on the slow path
+    const int *capacity;
+} gme_view;
+
+// Fairness policy. All hooks run with the mutex held, and only on the slow
+// path: while nobody is queued there is nothing to be fair about.
+typedef struct {
+    // May cls enter now? Only asked when cls fits (room empty or held by cls,
+    // below capacity).
+    int (*may_enter)(void *ctx, const gme_view *view, int cls);
+    // cls was admitted on the slow path; view already counts it.
+    void (*admitted)(void *ctx, const gme_view *view, int cls);
+    // The room is empty and threads are queued: which class to wake. left is
+    // the class of the thread that emptied it.
+    int (*next_class)(void *ctx, const gme_view *view, int left);
+} gme_policy;
+
+// Greedy: a fitting class is always admitted, the empty room goes round-robin
+// to the next waiting class after the one that left.
+extern const gme_policy gme_greedy;
+
+// Phase: like greedy, but the class inside stops admitting after batch
+// admissions or ms milliseconds once another class is waiting, so the room
+// drains and flips. Takes a gme_phase_state as ctx.
+extern const gme_policy gme_phase;
+
+typedef struct {
+    int batch;
+    int ms;
+    int phase_class;
+    int admissions;
+    uint64_t start_ns;
+} gme_phase_state;
+
+void gme_phase_init(gme_phase_state *state, int batch, int ms);
+
+typedef struct {
+    int classes;
+    const int *capacity;            // per class, 1..GME_MAX_CAPACITY
+    const gme_policy *policy;       // NULL for gme_greedy
+    void *policy_ctx;
+    int flags;
+    // Called on every wait, enter and leave with the room as it is right after
+    // the change. May run under the mutex, so it must not block.
+    void (*observer)(void *ctx, enum gme_event event, int cls, int inside, int occupancy);
+    void *observer_ctx;
+} gme_config;
+
+typedef struct {
+    _Atomic uint64_t word;
+    pthread_mutex_t mutex;
+    pthread_cond_t *conds;
+    int *waiting;
+    int *capacity;
+    int classes;
+    int flags;
+    const gme_policy *policy;
+    void *policy_ctx;
+    void (*observer)(void *ctx, enum gme_event event, int cls, int inside, int occupancy);
+    void *observer_ctx;
+    unsigned long futile_wakeups;   // woken, but still could not enter
+} gme;
+
+// Returns 0 on success, -1 on invalid config or allocation failure.
+int gme_init(gme *g, const gme_config *config);
+void gme_destroy(gme *g);
+
+void gme_enter(gme *g, int cls);
+void gme_leave(gme *g, int cls);
+
+#endif
@@ -0,0 +1,318 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/resource.h>
+#include "gme.h"
+
+// Stress test and benchmark for the group mutual exclusion library. Every
+// case runs the same threads (thread i uses class i % K) through every
+// library variant: mutex only or CAS fast path, targeted or broadcast
+// wakeups, greedy or phase policy.
+//
+// With -S every thread checks, while inside, that its class is under its
+// capacity and that no other class is inside. Holds are randomized and
+// sometimes yield the CPU. Any violation, or a case that stops making
+// progress, fails the run.
+//
+// Build: gcc -O2 -pthread -o gme_bench gme_bench.c gme.c
+// Run:   ./gme_bench -S
+
+#define STALL_SECONDS 10
+#define POLL_US 10000
+
+typedef struct {
+    const char *name;
+    int flags;
+    int phase;
+} variant;
+
+static const variant all_variants[] = {
+    {"mutex", GME_LOCK_ONLY, 0},
+    {"mutex+bcast", GME_LOCK_ONLY | GME_WAKE_ALL, 0},
+    {"mutex+phase", GME_LOCK_ONLY, 1},
+    {"fast", 0, 0},
+    {"fast+bcast", GME_WAKE_ALL, 0},
+    {"fast+phase", 0, 1},
+};
+
+typedef struct {
+    pthread_t thread;
+    int cls;
+    uint64_t rng;
+} bench_thread;
+
+typedef struct {
+    const char *variant;
+    int classes;
+    double seconds;
+    double ops_per_sec;
+    double switches_per_op;
+    double futile_per_op;
+    unsigned long violations;
+} case_result;
+
+static gme room;
+static int stress = 0;
+static int ops_per_thread = 20000;
+static int *capacity;
+static _Atomic int *inside;         // per class, maintained by the threads themselves
+static atomic_ulong violations;
+static atomic_ulong progress;
+static atomic_int finished;
+
+// Holds and capacities only need a few random bits per call: a 64-bit LCG
+// step, using the well mixed high half.
+static uint32_t next_random(uint64_t *state) {
+    *state = *state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (uint32_t)(*state >> 32);
+}
+
+static double seconds_since(const struct timespec *start) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec - start->tv_sec) + (ts.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void spin_work(uint32_t iterations) {
+    for (volatile uint32_t i = 0; i < iterations; i++) {
+    }
+}
+
+static void check_inside(int cls, int classes) {
+    int count = atomic_fetch_add(&inside[cls], 1) + 1;
+    if (count > capacity[cls]) {
+        atomic_fetch_add(&violations, 1);
+    }
+    for (int k = 0; k < classes; k++) {
+        if (k != cls && atomic_load(&inside[k]) != 0) {
+            atomic_fetch_add(&violations, 1);
+        }
+    }
+}
+
+static void *run_thread(void *arg) {
+    bench_thread *t = arg;
+    for (int i = 0; i < ops_per_thread; i++) {
+        gme_enter(&room, t->cls);
+        if (stress) {
+            check_inside(t->cls, room.classes);
+            uint32_t r = next_random(&t->rng);
+            if ((r >> 28) == 0) {
+                sched_yield();
+            } else {
+                spin_work(r & 1023);
+            }
+            atomic_fetch_sub(&inside[t->cls], 1);
+        } else {
+            spin_work(next_random(&t->rng) & 255);
+        }
+        gme_leave(&room, t->cls);
+        spin_work(next_random(&t->rng) & 255);
+        atomic_fetch_add_explicit(&progress, 1, memory_order_relaxed);
+    }
+    atomic_fetch_add(&finished, 1);
+    return NULL;
+}
+
+// "-k 2,4,8": one case group per class count. Returns how many were given,
+// or -1 when the list is malformed or longer than max.
+static int parse_class_counts(const char *str, int *counts, int max) {
+    int count = 0;
+    while (1) {
+        char *endptr;
+        long value = strtol(str, &endptr, 10);
+        if (endptr == str || value <= 0 || value > GME_MAX_CLASSES || count == max) return -1;
+        counts[count++] = (int)value;
+        if (*endptr == '\0') return count;
+        if (*endptr != ',') return -1;
+        str = endptr + 1;
+    }
+}
+
+// Runs one case; returns 0 when it completed, 1 when it stalled.
+static int run_case(const variant *v, int classes, int threads, int max_capacity, uint64_t seed,
+                    case_result *result) {
+    uint64_t rng = seed;
+    for (int k = 0; k < classes; k++) {
+        capacity[k] = stress ? 1 + (int)(next_random(&rng) % (uint32_t)max_capacity) : max_capacity;
+        atomic_init(&inside[k], 0);
+    }
+    gme_phase_state phase;
+    gme_phase_init(&phase, 8, 5);
+    gme_config config = {
+        .classes = classes,
+        .capacity = capacity,
+        .policy = v->phase ? &gme_phase : &gme_greedy,
+        .policy_ctx = &phase,
+        .flags = v->flags
+    };
+    if (gme_init(&room, &config) != 0) {
+        printf("Error: cannot initialize the room\n");
+        exit(1);
+    }
+    atomic_store(&violations, 0);
+    atomic_store(&progress, 0);
+    atomic_store(&finished, 0);
+
+    bench_thread *pool = calloc(threads, sizeof(bench_thread));
+    if (!pool) {
+        printf("Cannot allocate memory for threads\n");
+        exit(1);
+    }
+    struct rusage before, after;
+    getrusage(RUSAGE_SELF, &before);
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < threads; i++) {
+        pool[i].cls = i % classes;
+        pool[i].rng = seed + 0x9E3779B97F4A7C15ULL * (i + 1);
+        if (pthread_create(&pool[i].thread, NULL, run_thread, &pool[i]) != 0) {
+            printf("Error: cannot create thread %d\n", i);
+            exit(1);
+        }
+    }
+
+    // A lost wakeup shows up as a case that stops making progress.
+    unsigned long last = 0;
+    int idle_polls = 0;
+    while (atomic_load(&finished) < threads) {
+        usleep(POLL_US);
+        unsigned long done = atomic_load_explicit(&progress, memory_order_relaxed);
+        if (done != last) {
+            last = done;
+            idle_polls = 0;
+        } else if (++idle_polls > STALL_SECONDS * (1000000 / POLL_US)) {
+            return 1;
+        }
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(pool[i].thread, NULL);
+    }
+    double seconds = seconds_since(&start);
+    getrusage(RUSAGE_SELF, &after);
+    long switches = (after.ru_nvcsw - before.ru_nvcsw) + (after.ru_nivcsw - before.ru_nivcsw);
+
+    double ops = (double)threads * ops_per_thread;
+    result->variant = v->name;
+    result->classes = classes;
+    result->seconds = seconds;
+    result->ops_per_sec = ops / seconds;
+    result->switches_per_op = switches / ops;
+    result->futile_per_op = room.futile_wakeups / ops;
+    result->violations = atomic_load(&violations);
+
+    free(pool);
+    return 0;
+}
+
+// All cases of a run as one JSON object, written once the run is over.
+static int write_results(const char *path, const case_result *results, int count, int threads,
+                         int max_capacity, uint64_t seed) {
+    FILE *json = fopen(path, "w");
+    if (!json) {
+        return 1;
+    }
+    fprintf(json, "{\"stress\": %d, \"threads\": %d, \"ops_per_thread\": %d, \"capacity\": %d, "
+            "\"seed\": %llu, \"results\": [",
+            stress, threads, ops_per_thread, max_capacity, (unsigned long long)seed);
+    for (int i = 0; i < count; i++) {
+        const case_result *r = &results[i];
+        fprintf(json,
+                "%s\n  {\"variant\": \"%s\", \"classes\": %d, \"seconds\": %.6f, "
+                "\"ops_per_sec\": %.2f, \"switches_per_op\": %.4f, \"futile_per_op\": %.4f, "
+                "\"violations\": %lu}",
+                i ? "," : "", r->variant, r->classes, r->seconds, r->ops_per_sec, r->switches_per_op,
+                r->futile_per_op, r->violations);
+    }
+    fprintf(json, "\n]}\n");
+    return fclose(json) != 0;
+}
+
+static void print_usage(const char *program) {
+    fprintf(stderr, "Usage: %s [options]\n", program);
+    fprintf(stderr, "  -S - stress: random capacities and holds, check exclusion invariants\n");
+    fprintf(stderr, "  -k K1,K2,... - class counts to run (default 2,4,8)\n");
+    fprintf(stderr, "  -t T - threads per case (default 64)\n");
+    fprintf(stderr, "  -c C - capacity per class, the upper bound with -S (default 4)\n");
+    fprintf(stderr, "  -n OPS - enter/leave pairs per thread (default 20000)\n");
+    fprintf(stderr, "  -s SEED - seed for capacities and holds (default: current time)\n");
+    fprintf(stderr, "  -o FILE - write the results as JSON\n");
+    fprintf(stderr, "Example: %s -S && %s -o results.json\n", program, program);
+}
+
+int main(int argc, char *argv[]) {
+    const char *json_path = NULL;
+    const char *classes_arg = "2,4,8";
+    int threads = 64;
+    int max_capacity = 4;
+    uint64_t seed = (uint64_t)time(NULL);
+
+    int opt;
+    while ((opt = getopt(argc, argv, "Sk:t:c:n:s:o:h")) != -1) {
+        switch (opt) {
+            case 'S': stress = 1; break;
+            case 'k': classes_arg = optarg; break;
+            case 't': threads = atoi(optarg); break;
+            case 'c': max_capacity = atoi(optarg); break;
+            case 'n': ops_per_thread = atoi(optarg); break;
+            case 's': seed = strtoull(optarg, NULL, 10); break;
+            case 'o': json_path = optarg; break;
+            default:
+                print_usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    int class_counts[GME_MAX_CLASSES];
+    int class_count = parse_class_counts(classes_arg, class_counts, GME_MAX_CLASSES);
+    if (class_count <= 0 || threads <= 0 || ops_per_thread <= 0 ||
+        max_capacity <= 0 || max_capacity > GME_MAX_CAPACITY) {
+        printf("Error: invalid classes, threads, capacity or operations.\n");
+        return 1;
+    }
+    int variant_count = (int)(sizeof(all_variants) / sizeof(all_variants[0]));
+    capacity = malloc(sizeof(int) * GME_MAX_CLASSES);
+    inside = malloc(sizeof(*inside) * GME_MAX_CLASSES);
+    case_result *results = malloc(sizeof(case_result) * class_count * variant_count);
+    if (!capacity || !inside || !results) {
+        printf("Cannot allocate memory for classes\n");
+        return 1;
+    }
+
+    printf("Seed: %llu\n", (unsigned long long)seed);
+    printf("%-12s %7s %12s %10s %10s %10s\n", "variant", "classes", "ops/s", "cs/op", "futile/op", "check");
+
+    int failed = 0;
+    int done = 0;
+    for (int c = 0; c < class_count; c++) {
+        for (int v = 0; v < variant_count; v++) {
+            const variant *var = &all_variants[v];
+            case_result *r = &results[done];
+            if (run_case(var, class_counts[c], threads, max_capacity, seed + c, r) != 0) {
+                // Threads are still blocked in the room, so there is no clean way on.
+                printf("%-12s %7d stalled for %d s: lost wakeup\n", var->name, class_counts[c], STALL_SECONDS);
+                return 2;
+            }
+            gme_destroy(&room);
+            done++;
+            const char *check = !stress ? "-" : r->violations ? "FAIL" : "ok";
+            failed |= r->violations != 0;
+            printf("%-12s %7d %12.0f %10.3f %10.3f %10s\n", r->variant, r->classes,
+                   r->ops_per_sec, r->switches_per_op, r->futile_per_op, check);
+        }
+    }
+
+    if (json_path && write_results(json_path, results, done, threads, max_capacity, seed) != 0) {
+        printf("Error: cannot write %s\n", json_path);
+        failed = 1;
+    }
+    free(results);
+    free(capacity);
+    free(inside);
+    return failed;
+}
@@ -4,15 +4,55 @@
 #include <unistd.h>
 #include <limits.h>
 #include <time.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <stdatomic.h>
+#include <stdalign.h>
+#include <math.h>
+#include "gme.h"
 
+// Unisex bathroom: women and men share a room of limited capacity, never
+// both at once. Demo by default, load test with --bench.
+//
+// Build: gcc -O2 -pthread -o 5 main.c gme.c -lm
+// Run:   ./5 3
 
-pthread_mutex_t mutex;
-pthread_cond_t cond_women;
-pthread_cond_t cond_men;
-int women_count = 0;  
-int men_count = 0;    
+// The bathroom is a two-class group mutual exclusion (gme.h).
+#define CLASS_WOMEN 0
+#define CLASS_MEN 1
+
+gme room;
 int max_capacity;     
-volatile int running = 1; 
+
+// Signal mode wakes one admissible waiter per freed slot, and each admitted
+// thread passes the wakeup on while slots remain. Broadcast mode is the
+// original wake-everyone behaviour, kept for comparison. The fast path admits
+// with a CAS while nobody waits; without it every enter and leave locks.
+int wakeup_broadcast = 0;
+int fastpath = 0;
+
+// Visit times come from a per-thread splitmix64 (rand() is not thread-safe
+// and its hidden lock serializes every visitor). Each thread starts at its
+// own point of the Weyl sequence, so one --seed replays the whole run.
+uint64_t rng_seed;
+_Thread_local uint64_t thread_rng;
+
+void seed_thread_random(uint64_t thread_index) {
+    thread_rng = rng_seed ^ (thread_index * 0xd1b54a32d192ed03ULL);
+}
+
+uint64_t next_random() {
+    uint64_t z = (thread_rng += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// Uniform in [0, bound).
+uint32_t random_below(uint32_t bound) {
+    return (uint32_t)(((next_random() >> 32) * bound) >> 32);
+}
 
 enum bathroom_state {
     EMPTY,
@@ -21,97 +61,258 @@ enum bathroom_state {
 };
 
 
-enum bathroom_state get_state() {
-    if (women_count == 0 && men_count == 0) return EMPTY;
-    if (women_count > 0) return WOMEN_ONLY;
+enum bathroom_state get_state(int women, int men) {
+    if (women == 0 && men == 0) return EMPTY;
+    if (women > 0) return WOMEN_ONLY;
     return MEN_ONLY;
 }
 
 
-void print_state(const char *action) {
-    enum bathroom_state state = get_state();
+void print_state(const char *action, int women, int men) {
+    enum bathroom_state state = get_state(women, men);
     printf("%s: ", action);
     switch (state) {
         case EMPTY: printf("Empty"); break;
-        case WOMEN_ONLY: printf("Women only (%d)", women_count); break;
-        case MEN_ONLY: printf("Men only (%d)", men_count); break;
+        case WOMEN_ONLY: printf("Women only (%d)", women); break;
+        case MEN_ONLY: printf("Men only (%d)", men); break;
     }
-    printf(" | Total: %d\n", women_count + men_count);
-    fflush(stdout);
+    printf(" | Total: %d\n", women + men);
 }
 
-void woman_wants_to_enter() {
-    pthread_mutex_lock(&mutex);
-    while (men_count > 0 || (women_count + men_count >= max_capacity)) {
-        printf("Woman waiting... (Men: %d, Total: %d)\n", men_count, women_count + men_count);
-        pthread_cond_wait(&cond_women, &mutex);
+// Event log: the monitor never touches stdio. Each worker thread appends
+// small records to its own single-producer ring, usually while it still holds
+// the mutex, and a drainer thread merges the rings by sequence number and
+// prints them. A full ring drops the event instead of blocking the lock
+// holder.
+#define EVENT_RING_SIZE 256
+#define EVENT_DRAIN_INTERVAL_US 10000
+
+enum event_type {
+    EVENT_WOMAN_WAITS,
+    EVENT_MAN_WAITS,
+    EVENT_WOMAN_ENTERS,
+    EVENT_MAN_ENTERS,
+    EVENT_WOMAN_LEAVES,
+    EVENT_MAN_LEAVES
+};
+
+typedef struct {
+    uint64_t seq;
+    int32_t type;
+    int32_t women;
+    int32_t men;
+    int32_t reserved;
+} event_record;
+
+typedef struct {
+    alignas(64) _Atomic uint64_t head;  // written by the worker
+    uint64_t dropped;
+    alignas(64) _Atomic uint64_t tail;  // written by the drainer
+    alignas(64) event_record events[EVENT_RING_SIZE];
+} event_ring;
+
+int logging = 1;
+int event_ring_count;
+event_ring *event_rings;
+uint64_t *event_heads;          // drainer only: heads seen in the current drain
+int *event_heap;                // drainer only: rings ordered by their oldest record
+uint64_t event_next_seq;        // drainer only: the next record to print
+_Atomic uint64_t event_seq;
+atomic_int event_stop;
+pthread_t event_drainer_thread;
+_Thread_local event_ring *thread_ring;
+
+void log_event(int type, int women, int men) {
+    event_ring *ring = thread_ring;
+    if (!logging || !ring) {
+        return;
+    }
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) == EVENT_RING_SIZE) {
+        ring->dropped++;
+        return;
     }
-    women_count++;
-    print_state("Woman enters");
-    pthread_mutex_unlock(&mutex);
-    pthread_cond_broadcast(&cond_men);
-    pthread_cond_broadcast(&cond_women);
+    event_record *record = &ring->events[head & (EVENT_RING_SIZE - 1)];
+    record->seq = atomic_fetch_add_explicit(&event_seq, 1, memory_order_relaxed);
+    record->type = type;
+    record->women = women;
+    record->men = men;
+    record->reserved = 0;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
 }
 
-void man_wants_to_enter() {
-    pthread_mutex_lock(&mutex);
-    while (women_count > 0 || (women_count + men_count >= max_capacity)) {
-        printf("Man waiting... (Women: %d, Total: %d)\n", women_count, women_count + men_count);
-        pthread_cond_wait(&cond_men, &mutex);
+void render_event(const event_record *record) {
+    switch (record->type) {
+        case EVENT_WOMAN_WAITS:
+            printf("Woman waiting... (Men: %d, Total: %d)\n", record->men, record->women + record->men);
+            break;
+        case EVENT_MAN_WAITS:
+            printf("Man waiting... (Women: %d, Total: %d)\n", record->women, record->women + record->men);
+            break;
+        case EVENT_WOMAN_ENTERS: print_state("Woman enters", record->women, record->men); break;
+        case EVENT_MAN_ENTERS: print_state("Man enters", record->women, record->men); break;
+        case EVENT_WOMAN_LEAVES: print_state("Woman leaves", record->women, record->men); break;
+        case EVENT_MAN_LEAVES: print_state("Man leaves", record->women, record->men); break;
     }
-    men_count++;
-    print_state("Man enters");
-    pthread_mutex_unlock(&mutex);
-    pthread_cond_broadcast(&cond_women);
-    pthread_cond_broadcast(&cond_men);
 }
 
-void woman_leaves() {
-    pthread_mutex_lock(&mutex);
-    if (women_count > 0) {
-        women_count--;
-        print_state("Woman leaves");
-        pthread_cond_broadcast(&cond_men);
-        pthread_cond_broadcast(&cond_women);
-    }
-    pthread_mutex_unlock(&mutex);
+uint64_t event_oldest(int ring_id) {
+    event_ring *ring = &event_rings[ring_id];
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    return ring->events[tail & (EVENT_RING_SIZE - 1)].seq;
 }
 
-void man_leaves() {
-    pthread_mutex_lock(&mutex);
-    if (men_count > 0) {
-        men_count--;
-        print_state("Man leaves");
-        pthread_cond_broadcast(&cond_women);
-        pthread_cond_broadcast(&cond_men);
+void event_sift_down(int count, int root) {
+    while (2 * root + 1 < count) {
+        int child = 2 * root + 1;
+        if (child + 1 < count && event_oldest(event_heap[child + 1]) < event_oldest(event_heap[child])) {
+            child++;
+        }
+        if (event_oldest(event_heap[root]) <= event_oldest(event_heap[child])) {
+            break;
+        }
+        int swap = event_heap[root];
+        event_heap[root] = event_heap[child];
+        event_heap[child] = swap;
+        root = child;
     }
-    pthread_mutex_unlock(&mutex);
 }
 
+// A dropped event never takes a sequence number, so the numbers have no
+// holes. Each ring is in sequence order and the rings are merged through a
+// heap keyed by their oldest record. The watermark is event_next_seq: when
+// no ring offers it, a worker has taken it but not published it yet, and
+// everything after it waits in the rings for the next drain.
+void event_drain(int final) {
+    int heap_count = 0;
+    for (int i = 0; i < event_ring_count; i++) {
+        event_ring *ring = &event_rings[i];
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        event_heads[i] = head;
+        if (atomic_load_explicit(&ring->tail, memory_order_relaxed) != head) {
+            event_heap[heap_count++] = i;
+        }
+    }
+    for (int i = heap_count / 2 - 1; i >= 0; i--) {
+        event_sift_down(heap_count, i);
+    }
 
-void* woman_thread() {
-    int attempts = rand() % 3 + 1;
-    for (int i = 0; i < attempts && running; i++) {
-        usleep((rand() % 500) * 1000);
-        woman_wants_to_enter();
-        usleep((rand() % 1000 + 500) * 1000);
-        woman_leaves();
-        usleep((rand() % 1000) * 1000);
+    int printed = 0;
+    while (heap_count > 0 && (final || event_oldest(event_heap[0]) == event_next_seq)) {
+        event_ring *ring = &event_rings[event_heap[0]];
+        uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        event_record record = ring->events[tail & (EVENT_RING_SIZE - 1)];
+        atomic_store_explicit(&ring->tail, ++tail, memory_order_release);
+        if (tail == event_heads[event_heap[0]]) {
+            event_heap[0] = event_heap[--heap_count];
+        }
+        event_sift_down(heap_count, 0);
+        event_next_seq = record.seq + 1;
+        render_event(&record);
+        printed = 1;
+    }
+    if (printed) {
+        fflush(stdout);
     }
+}
+
+void* event_drainer(void *arg) {
+    (void)arg;
+    while (!atomic_load(&event_stop)) {
+        event_drain(0);
+        usleep(EVENT_DRAIN_INTERVAL_US);
+    }
+    event_drain(1);
     return NULL;
 }
 
+void event_free() {
+    free(event_rings);
+    free(event_heads);
+    free(event_heap);
+}
 
-void* man_thread() {
-    int attempts = rand() % 3 + 1;
-    for (int i = 0; i < attempts && running; i++) {
-        usleep((rand() % 500) * 1000);
-        man_wants_to_enter();
-        usleep((rand() % 1000 + 500) * 1000); 
-        man_leaves();
-        usleep((rand() % 1000) * 1000); 
+int event_log_start(int rings) {
+    // One ring per worker; the alignas members only hold if the array itself
+    // starts on a cache line, which malloc does not promise.
+    if (posix_memalign((void **)&event_rings, 64, rings * sizeof(event_ring)) != 0) {
+        return 1;
     }
-    return NULL;
+    event_heads = malloc(rings * sizeof(uint64_t));
+    event_heap = malloc(rings * sizeof(int));
+    if (!event_heads || !event_heap) {
+        event_free();
+        return 1;
+    }
+    for (int i = 0; i < rings; i++) {
+        atomic_init(&event_rings[i].head, 0);
+        atomic_init(&event_rings[i].tail, 0);
+        event_rings[i].dropped = 0;
+    }
+    event_ring_count = rings;
+    event_next_seq = 0;
+    atomic_store(&event_stop, 0);
+    if (pthread_create(&event_drainer_thread, NULL, event_drainer, NULL) != 0) {
+        event_free();
+        return 1;
+    }
+    return 0;
+}
+
+void event_log_finish() {
+    atomic_store(&event_stop, 1);
+    pthread_join(event_drainer_thread, NULL);
+    uint64_t dropped = 0;
+    for (int i = 0; i < event_ring_count; i++) {
+        dropped += event_rings[i].dropped;
+    }
+    if (dropped) {
+        fprintf(stderr, "Log: %llu events dropped (ring full)\n", (unsigned long long)dropped);
+    }
+    event_free();
+}
+
+// Admission policy. Greedy admits a gender whenever the other count is zero,
+// so a steady stream of one gender starves the other. Phase closes the current
+// gender's phase after phase_batch admissions or phase_ms milliseconds, but
+// only while the other side is waiting; the room then drains and flips.
+enum policy {
+    POLICY_GREEDY,
+    POLICY_PHASE
+};
+
+enum policy policy = POLICY_GREEDY;
+int phase_batch = 16;
+int phase_ms = 10;
+gme_phase_state phase_state;
+
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Room observer: turns library events into log records. The event types are
+// laid out so that type = 2 * event + class.
+void log_room(void *ctx, enum gme_event event, int cls, int inside, int occupancy) {
+    (void)ctx;
+    log_event(2 * event + cls, inside == CLASS_WOMEN ? occupancy : 0, inside == CLASS_MEN ? occupancy : 0);
+}
+
+void woman_wants_to_enter() {
+    gme_enter(&room, CLASS_WOMEN);
+}
+
+void man_wants_to_enter() {
+    gme_enter(&room, CLASS_MEN);
+}
+
+void woman_leaves() {
+    gme_leave(&room, CLASS_WOMEN);
+}
+
+void man_leaves() {
+    gme_leave(&room, CLASS_MEN);
 }
 
 typedef enum {
@@ -130,68 +331,447 @@ statusCode str_to_int(const char *str, int *res) {
     return SUCCESS;
 }
 
-int main(int argc, char **argv) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <N>\n", argv[0]);
-        return INVALID_ARGS;
+// Load model. Clients are people who visit the room visit_count times; they
+// are heap records spread over worker_count threads, so the client count is
+// bounded by memory, not by threads. The demo (default) sleeps for hundreds of
+// milliseconds and prints every change. The benchmark (--bench) is silent and
+// replaces the sleeps with short busy loops, so every context switch counted
+// comes from the monitor itself. --rate switches either to open-loop Poisson
+// arrivals at R visits per second in total.
+int bench_mode = 0;
+int client_count = 0;       // 0: N + 2 for the demo, 1000 for the benchmark
+int visit_count = 0;        // 0: 1-3 per client for the demo, 100 for the benchmark
+int worker_count = 0;       // 0: one per client, at most 1000
+int women_pct = -1;         // -1: random split for the demo, 50 for the benchmark
+int stay_us = 0;
+double arrival_rate = 0.0;  // 0: closed loop
+pthread_barrier_t run_start;
+uint64_t run_start_ns;
+
+typedef struct {
+    uint64_t next_arrival_ns;
+    int visits_left;
+    int is_woman;
+} client;
+
+// Wait-to-enter times. Row r > 0 of the table covers [8, 16) << (r - 1)
+// nanoseconds in 8 equal steps, so a reported percentile is at most 1/8
+// above the real wait; row 0 holds 0..7 ns exactly. Waits are clamped at
+// 2^40 ns. Only the owning worker writes its table, and run_clients sums
+// them after the join, so plain counters are enough.
+#define WAIT_STEPS 8
+#define WAIT_ROWS 38
+#define WAIT_LIMIT_NS (1ULL << 40)
+
+typedef struct {
+    uint64_t counts[WAIT_ROWS][WAIT_STEPS];
+    uint64_t total;
+    uint64_t longest;
+} wait_histogram;
+
+typedef struct {
+    pthread_t thread;
+    int id;
+    int *heap;              // client indices, earliest next arrival first
+    int heap_size;
+    uint64_t arrival_clock;         // last arrival of this worker's Poisson stream
+    wait_histogram waits[2];        // indexed by client.is_woman
+} worker;
+
+client *clients;
+
+void wait_record(wait_histogram *histogram, uint64_t ns) {
+    if (ns >= WAIT_LIMIT_NS) {
+        ns = WAIT_LIMIT_NS - 1;
+    }
+    int row = 0;
+    int shift = 0;
+    if (ns >= WAIT_STEPS) {
+        shift = 60 - __builtin_clzll(ns);   // brings ns into [8, 16)
+        row = shift + 1;
     }
+    histogram->counts[row][(ns >> shift) & (WAIT_STEPS - 1)]++;
+    histogram->total++;
+    if (ns > histogram->longest) {
+        histogram->longest = ns;
+    }
+}
 
-    statusCode err = str_to_int(argv[1], &max_capacity);
-    if (err != SUCCESS) {
-        fprintf(stderr, "N must be a positive integer\n");
-        return INVALID_ARGS;
+void wait_add(wait_histogram *into, const wait_histogram *from) {
+    for (int row = 0; row < WAIT_ROWS; row++) {
+        for (int step = 0; step < WAIT_STEPS; step++) {
+            into->counts[row][step] += from->counts[row][step];
+        }
+    }
+    into->total += from->total;
+    if (from->longest > into->longest) {
+        into->longest = from->longest;
+    }
+}
+
+// Upper edge of the cell holding the given fraction of waits, capped by the
+// longest wait seen.
+uint64_t wait_percentile(const wait_histogram *histogram, double fraction) {
+    uint64_t rank = (uint64_t)ceil(fraction * histogram->total);
+    if (rank < 1) rank = 1;
+    uint64_t seen = 0;
+    for (int row = 0; row < WAIT_ROWS; row++) {
+        for (int step = 0; step < WAIT_STEPS; step++) {
+            seen += histogram->counts[row][step];
+            if (seen < rank) continue;
+            uint64_t high = row == 0 ? (uint64_t)step : ((uint64_t)(WAIT_STEPS + step + 1) << (row - 1)) - 1;
+            return high < histogram->longest ? high : histogram->longest;
+        }
     }
+    return histogram->longest;
+}
 
-   
-    if (pthread_mutex_init(&mutex, NULL) != 0) {
-        printf("Failed to initialize mutex");
-        return INIT_ERROR;
+void spin_work(uint32_t iterations) {
+    for (volatile uint32_t i = 0; i < iterations; i++) {
     }
-    if (pthread_cond_init(&cond_women, NULL) != 0) {
-        printf("Failed to initialize women condition");
-        pthread_mutex_destroy(&mutex);
-        return INIT_ERROR;
+}
+
+void sleep_until(uint64_t deadline_ns) {
+    struct timespec ts = {
+        .tv_sec = (time_t)(deadline_ns / 1000000000ULL),
+        .tv_nsec = (long)(deadline_ns % 1000000000ULL)
+    };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0) {
     }
-    if (pthread_cond_init(&cond_men, NULL) != 0) {
-        printf("Failed to initialize men condition");
-        pthread_mutex_destroy(&mutex);
-        pthread_cond_destroy(&cond_women);
-        return INIT_ERROR;
+}
+
+// Exponential gap with the given mean: inter-arrival times of a Poisson process.
+uint64_t exponential_ns(double mean_ns) {
+    double u = ((next_random() >> 11) + 1) * 0x1p-53;
+    return (uint64_t)(-log(u) * mean_ns);
+}
+
+// Time inside the room: a short spin in the benchmark, or a sleep when
+// --stay-us models visitors that block (I/O) while holding their slot.
+void stay_inside() {
+    if (stay_us > 0) {
+        usleep(random_below(stay_us) + 1);
+    } else if (bench_mode) {
+        spin_work(random_below(2000));
+    } else {
+        usleep((random_below(1000) + 500) * 1000);
     }
+}
 
-    srand(time(NULL));
-    const int total_threads = max_capacity + 2; 
-    pthread_t threads[total_threads];
-    int women_threads = rand() % (total_threads / 2 + 1) + 1;
-    int men_threads = total_threads - women_threads; 
+// Next arrival time for a client of worker w. With --rate each worker runs a
+// Poisson stream of arrival_rate / worker_count and hands its arrivals to its
+// clients round-robin, so the total is a Poisson stream of arrival_rate and
+// the run ends after about visits / rate. In closed loop the gap counts from
+// the end of the client's last visit.
+uint64_t next_arrival(worker *w) {
+    if (arrival_rate > 0) {
+        w->arrival_clock += exponential_ns(worker_count / arrival_rate * 1e9);
+        return w->arrival_clock;
+    }
+    if (bench_mode) {
+        spin_work(random_below(2000));
+        return now_ns();
+    }
+    return now_ns() + (random_below(1000) + random_below(500)) * 1000000ULL;
+}
 
-    printf("Starting with %d women and %d men, max capacity = %d\n", women_threads, men_threads, max_capacity);
+int arrives_before(int a, int b) {
+    return clients[a].next_arrival_ns < clients[b].next_arrival_ns;
+}
 
-    
-    for (int i = 0; i < women_threads; i++) {
-        if (pthread_create(&threads[i], NULL, woman_thread, NULL) != 0) {
-            printf("Failed to create woman thread");
-            running = 0;
-            return THREAD_ERROR;
+void heap_sift_down(worker *w, int i) {
+    for (;;) {
+        int smallest = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
+        if (left < w->heap_size && arrives_before(w->heap[left], w->heap[smallest])) smallest = left;
+        if (right < w->heap_size && arrives_before(w->heap[right], w->heap[smallest])) smallest = right;
+        if (smallest == i) return;
+        int tmp = w->heap[i];
+        w->heap[i] = w->heap[smallest];
+        w->heap[smallest] = tmp;
+        i = smallest;
+    }
+}
+
+void* worker_thread(void *arg) {
+    worker *w = arg;
+    seed_thread_random((uint64_t)w->id);
+    if (logging) {
+        thread_ring = &event_rings[w->id - 1];
+    }
+    pthread_barrier_wait(&run_start);
+
+    w->arrival_clock = run_start_ns;
+    for (int i = 0; i < w->heap_size; i++) {
+        client *c = &clients[w->heap[i]];
+        c->next_arrival_ns = arrival_rate > 0 || bench_mode ? next_arrival(w)
+                           : run_start_ns + random_below(500) * 1000000ULL;
+    }
+    for (int i = w->heap_size / 2 - 1; i >= 0; i--) {
+        heap_sift_down(w, i);
+    }
+
+    while (w->heap_size > 0) {
+        client *c = &clients[w->heap[0]];
+        uint64_t now = now_ns();
+        if (c->next_arrival_ns > now) {
+            sleep_until(c->next_arrival_ns);
+        } else if (arrival_rate == 0) {
+            // Closed loop has no schedule to fall behind: the client arrives
+            // when its worker gets to it.
+            c->next_arrival_ns = now;
+        }
+        if (c->is_woman) {
+            woman_wants_to_enter();
+        } else {
+            man_wants_to_enter();
+        }
+        wait_record(&w->waits[c->is_woman], now_ns() - c->next_arrival_ns);
+        stay_inside();
+        if (c->is_woman) {
+            woman_leaves();
+        } else {
+            man_leaves();
+        }
+
+        if (--c->visits_left == 0) {
+            w->heap[0] = w->heap[--w->heap_size];
+        } else {
+            c->next_arrival_ns = next_arrival(w);
         }
+        heap_sift_down(w, 0);
     }
-    for (int i = 0; i < men_threads; i++) {
-        if (pthread_create(&threads[women_threads + i], NULL, man_thread, NULL) != 0) {
-            printf("Failed to create man thread");
-            running = 0;
-            return THREAD_ERROR;
+    return NULL;
+}
+
+void print_wait_stats(const char *label, const wait_histogram *histogram) {
+    if (histogram->total == 0) return;
+    printf("%s wait: p50 %.1f us, p99 %.1f us, max %.1f us\n", label,
+           wait_percentile(histogram, 0.50) / 1e3, wait_percentile(histogram, 0.99) / 1e3,
+           histogram->longest / 1e3);
+}
+
+statusCode run_clients() {
+    // The main thread is index 0, workers are 1..worker_count.
+    seed_thread_random(0);
+    if (client_count == 0) {
+        client_count = bench_mode ? 1000 : max_capacity + 2;
+    }
+    if (worker_count == 0 || worker_count > client_count) {
+        worker_count = client_count < 1000 ? client_count : 1000;
+    }
+    int women = women_pct >= 0 ? (int)((long)client_count * women_pct / 100)
+              : bench_mode ? client_count / 2
+              : (int)random_below(client_count / 2 + 1) + 1;
+
+    clients = calloc(client_count, sizeof(client));
+    worker *workers = calloc(worker_count, sizeof(worker));
+    int *heaps = malloc(sizeof(int) * client_count);
+    if (!clients || !workers || !heaps || pthread_barrier_init(&run_start, NULL, worker_count + 1) != 0) {
+        fprintf(stderr, "Failed to allocate %d clients\n", client_count);
+        free(clients);
+        free(workers);
+        free(heaps);
+        return INIT_ERROR;
+    }
+
+    // Women are spread evenly over the ids, so every worker gets a similar mix.
+    for (int i = 0; i < client_count; i++) {
+        clients[i].is_woman = (long)(i + 1) * women / client_count != (long)i * women / client_count;
+        clients[i].visits_left = visit_count ? visit_count : bench_mode ? 100 : (int)random_below(3) + 1;
+    }
+    // Client i goes to worker i % worker_count; each worker's heap is a slice of heaps.
+    int *slice = heaps;
+    for (int w = 0; w < worker_count; w++) {
+        workers[w].id = w + 1;
+        workers[w].heap = slice;
+        for (int i = w; i < client_count; i += worker_count) {
+            slice[workers[w].heap_size++] = i;
         }
+        slice += workers[w].heap_size;
+    }
+
+    printf("Starting with %d women and %d men on %d threads, max capacity = %d, seed = %llu\n",
+           women, client_count - women, worker_count, max_capacity, (unsigned long long)rng_seed);
+
+    if (logging && event_log_start(worker_count) != 0) {
+        fprintf(stderr, "Failed to start the event log, running quiet\n");
+        logging = 0;
     }
 
-    
-    for (int i = 0; i < total_threads; i++) {
-        pthread_join(threads[i], NULL);
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, 64 * 1024);
+    for (int w = 0; w < worker_count; w++) {
+        if (pthread_create(&workers[w].thread, &attr, worker_thread, &workers[w]) != 0) {
+            // Workers already created are parked on the barrier.
+            fprintf(stderr, "Failed to create worker thread %d\n", w);
+            exit(THREAD_ERROR);
+        }
     }
+    pthread_attr_destroy(&attr);
 
-    
-    pthread_mutex_destroy(&mutex);
-    pthread_cond_destroy(&cond_women);
-    pthread_cond_destroy(&cond_men);
+    struct rusage before, after;
+    getrusage(RUSAGE_SELF, &before);
+    run_start_ns = now_ns();
+    pthread_barrier_wait(&run_start);
+    wait_histogram waits[2];
+    memset(waits, 0, sizeof(waits));
+    for (int w = 0; w < worker_count; w++) {
+        pthread_join(workers[w].thread, NULL);
+        wait_add(&waits[0], &workers[w].waits[0]);
+        wait_add(&waits[1], &workers[w].waits[1]);
+    }
+    double elapsed = (now_ns() - run_start_ns) / 1e9;
+    getrusage(RUSAGE_SELF, &after);
+    if (logging) {
+        event_log_finish();
+    }
 
+    if (bench_mode) {
+        long voluntary = after.ru_nvcsw - before.ru_nvcsw;
+        long involuntary = after.ru_nivcsw - before.ru_nivcsw;
+        uint64_t admissions = waits[0].total + waits[1].total;
+        double per = 1.0 / admissions;
+        printf("Bench: capacity %d, %s wakeups, %s policy%s, %s\n", max_capacity,
+               wakeup_broadcast ? "broadcast" : "signal", policy == POLICY_PHASE ? "phase" : "greedy",
+               fastpath ? ", fast path" : "", arrival_rate > 0 ? "Poisson arrivals" : "closed loop");
+        printf("Admissions: %llu in %.3f s (%.0f/s)\n", (unsigned long long)admissions, elapsed,
+               admissions / elapsed);
+        printf("Context switches per admission: %.3f (voluntary %.3f, involuntary %.3f)\n",
+               (voluntary + involuntary) * per, voluntary * per, involuntary * per);
+        printf("Futile wakeups per admission: %.3f\n", room.futile_wakeups * per);
+        print_wait_stats("Women", &waits[1]);
+        print_wait_stats("Men", &waits[0]);
+    }
+
+    pthread_barrier_destroy(&run_start);
+    free(clients);
+    free(workers);
+    free(heaps);
     return SUCCESS;
-}
\ No newline at end of file
+}
+
+int parse_option(const char *arg) {
+    char *endptr;
+    if (strcmp(arg, "--bench") == 0) {
+        bench_mode = 1;
+        logging = 0;
+    } else if (strcmp(arg, "--quiet") == 0) {
+        logging = 0;
+    } else if (strcmp(arg, "--log") == 0) {
+        logging = 1;
+    } else if (strncmp(arg, "--clients=", 10) == 0) {
+        long value = strtol(arg + 10, &endptr, 10);
+        if (*endptr != '\0' || value <= 0 || value > 100000000) return -1;
+        client_count = (int)value;
+    } else if (strncmp(arg, "--visits=", 9) == 0) {
+        long value = strtol(arg + 9, &endptr, 10);
+        if (*endptr != '\0' || value <= 0 || value > INT_MAX) return -1;
+        visit_count = (int)value;
+    } else if (strncmp(arg, "--stay-us=", 10) == 0) {
+        long value = strtol(arg + 10, &endptr, 10);
+        if (*endptr != '\0' || value < 0 || value > 10000000) return -1;
+        stay_us = (int)value;
+    } else if (strncmp(arg, "--threads=", 10) == 0) {
+        long value = strtol(arg + 10, &endptr, 10);
+        if (*endptr != '\0' || value <= 0 || value > 100000) return -1;
+        worker_count = (int)value;
+    } else if (strncmp(arg, "--rate=", 7) == 0) {
+        arrival_rate = strtod(arg + 7, &endptr);
+        if (*endptr != '\0' || !(arrival_rate > 0)) return -1;
+    } else if (strcmp(arg, "--wakeup=signal") == 0) {
+        wakeup_broadcast = 0;
+    } else if (strcmp(arg, "--wakeup=broadcast") == 0) {
+        wakeup_broadcast = 1;
+    } else if (strncmp(arg, "--women=", 8) == 0) {
+        long value = strtol(arg + 8, &endptr, 10);
+        if (*endptr != '\0' || value < 0 || value > 100) return -1;
+        women_pct = (int)value;
+    } else if (strcmp(arg, "--fastpath") == 0) {
+        fastpath = 1;
+    } else if (strcmp(arg, "--policy=greedy") == 0) {
+        policy = POLICY_GREEDY;
+    } else if (strcmp(arg, "--policy=phase") == 0) {
+        policy = POLICY_PHASE;
+    } else if (strncmp(arg, "--batch=", 8) == 0) {
+        long value = strtol(arg + 8, &endptr, 10);
+        if (*endptr != '\0' || value <= 0 || value > INT_MAX) return -1;
+        phase_batch = (int)value;
+    } else if (strncmp(arg, "--phase-ms=", 11) == 0) {
+        long value = strtol(arg + 11, &endptr, 10);
+        if (*endptr != '\0' || value <= 0 || value > INT_MAX) return -1;
+        phase_ms = (int)value;
+    } else if (arg[0] != '-') {
+        rng_seed = strtoull(arg, &endptr, 10);
+        if (*endptr != '\0') return -1;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+void print_usage(const char *program) {
+    fprintf(stderr, "Usage: %s <N> [seed] [options]\n", program);
+    fprintf(stderr, "  --wakeup=signal|broadcast - targeted wakeups (default) or wake every waiter\n");
+    fprintf(stderr, "  --fastpath - admit with a CAS on a packed state word, locking only to wait\n");
+    fprintf(stderr, "  --policy=greedy|phase - admit whenever possible (default) or switch sides in phases\n");
+    fprintf(stderr, "  --batch=K - phase policy: yield after K admissions when the other side waits (default 16)\n");
+    fprintf(stderr, "  --phase-ms=T - phase policy: yield after T ms when the other side waits (default 10)\n");
+    fprintf(stderr, "  --quiet - do not print room events\n");
+    fprintf(stderr, "  --bench - run a silent load test and report admissions/s and context switches\n");
+    fprintf(stderr, "  --log - print room events even with --bench (put it after --bench)\n");
+    fprintf(stderr, "  --clients=C - number of clients (default N + 2, or 1000 with --bench)\n");
+    fprintf(stderr, "  --visits=V - visits per client (default 1-3, or 100 with --bench)\n");
+    fprintf(stderr, "  --threads=T - worker threads the clients are spread over (default min(C, 1000))\n");
+    fprintf(stderr, "  --rate=R - Poisson arrivals, R visits per second over all clients\n");
+    fprintf(stderr, "  --women=P - percentage of clients that are women (default random, or 50 with --bench)\n");
+    fprintf(stderr, "  --stay-us=U - sleep up to U us inside the room\n");
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        print_usage(argv[0]);
+        return INVALID_ARGS;
+    }
+
+    statusCode err = str_to_int(argv[1], &max_capacity);
+    if (err != SUCCESS) {
+        fprintf(stderr, "N must be a positive integer\n");
+        return INVALID_ARGS;
+    }
+
+    rng_seed = (uint64_t)time(NULL);
+    for (int a = 2; a < argc; a++) {
+        if (parse_option(argv[a]) != 0) {
+            fprintf(stderr, "Invalid option %s\n", argv[a]);
+            print_usage(argv[0]);
+            return INVALID_ARGS;
+        }
+    }
+    if (max_capacity > GME_MAX_CAPACITY) {
+        fprintf(stderr, "N must be below 2^24\n");
+        return INVALID_ARGS;
+    }
+
+    int capacity[2] = {max_capacity, max_capacity};
+    gme_phase_init(&phase_state, phase_batch, phase_ms);
+    gme_config config = {
+        .classes = 2,
+        .capacity = capacity,
+        .policy = policy == POLICY_PHASE ? &gme_phase : &gme_greedy,
+        .policy_ctx = &phase_state,
+        .flags = (fastpath ? 0 : GME_LOCK_ONLY) | (wakeup_broadcast ? GME_WAKE_ALL : 0),
+        .observer = log_room,
+        .observer_ctx = NULL
+    };
+    if (gme_init(&room, &config) != 0) {
+        printf("Failed to initialize the room");
+        return INIT_ERROR;
+    }
+
+    statusCode status = run_clients();
+    gme_destroy(&room);
+    return status;
+}
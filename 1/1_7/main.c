@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,6 +12,23 @@
 #include <fcntl.h>
 #include <sys/ioctl.h>
 #include <linux/fs.h>
+#include <linux/fiemap.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdalign.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/sysmacros.h>
+#include <sys/inotify.h>
+#include <sys/fanotify.h>
+#include <sys/statfs.h>
+#include <poll.h>
 
 #define COLOR_RESET   "\x1b[0m"    // Сброс цвета (используется после каждого цветного вывода)
 #define COLOR_BLUE    "\x1b[34m"   // Синий - для директорий
@@ -21,125 +39,56 @@
 #define COLOR_MAGENTA "\x1b[35m"   // Пурпурный - для блочных и символьных устройств
 #define COLOR_WHITE   "\x1b[37m"   // Белый - для обычных файлов
 
-int determine_permissions(char *perm_string, struct stat *stats) {
-    int temporary_mode;
-    char temp_char;
+#define TIME_TEXT_SIZE 64
 
-    
-    if (perm_string == NULL) {
-        fprintf(stderr, "Error in determine_permissions: Invalid input received\n");
-        return 1;
-    }
-    if (stats == NULL) {
-        fprintf(stderr, "Error in determine_permissions: Invalid input received\n");
-        return 1;
-    }
-
-    
-    temporary_mode = stats->st_mode;
-
-    
-    if (S_ISDIR(temporary_mode) == 1) {
-        temp_char = 'd';
-        perm_string[0] = temp_char;
-    }
-    else if (S_ISLNK(temporary_mode) == 1) {
-        temp_char = 'l';
-        perm_string[0] = temp_char;
-    }
-    else if (S_ISFIFO(temporary_mode) == 1) {
-        temp_char = 'p';
-        perm_string[0] = temp_char;
-    }
-    else if (S_ISCHR(temporary_mode) == 1) {
-        temp_char = 'c';
-        perm_string[0] = temp_char;
-    }
-    else if (S_ISBLK(temporary_mode) == 1) {
-        temp_char = 'b';
-        perm_string[0] = temp_char;
-    }
-    else if (S_ISSOCK(temporary_mode) == 1) {
-        temp_char = 's';
-        perm_string[0] = temp_char;
-    }
-    else {
-        temp_char = '-';
-        perm_string[0] = temp_char;
-    }
-
-        if ((temporary_mode & S_IRUSR) != 0) {
-        perm_string[1] = 'r';
-    } else {
-        perm_string[1] = '-';
-    }
-    if ((temporary_mode & S_IWUSR) != 0) {
-        perm_string[2] = 'w';
-    } else {
-        perm_string[2] = '-';
-    }
-    if ((temporary_mode & S_IXUSR) != 0) {
-        perm_string[3] = 'x';
-    } else {
-        perm_string[3] = '-';
-    }
+// Права доступа по таблицам: символ типа по битам S_IFMT и rwx-тройки по
+// младшим девяти битам режима. Таблица заполняется один раз при запуске.
+const char type_chars[16] = {
+    '-', 'p', 'c', '-', 'd', '-', 'b', '-', '-', '-', 'l', '-', 's', '-', '-', '-'
+};
+char permission_table[512][9];
 
-    
-    if ((temporary_mode & S_IRGRP) != 0) {
-        perm_string[4] = 'r';
-    } else {
-        perm_string[4] = '-';
-    }
-    if ((temporary_mode & S_IWGRP) != 0) {
-        perm_string[5] = 'w';
-    } else {
-        perm_string[5] = '-';
-    }
-    if ((temporary_mode & S_IXGRP) != 0) {
-        perm_string[6] = 'x';
-    } else {
-        perm_string[6] = '-';
+void init_permission_table() {
+    static const char letters[] = "rwxrwxrwx";
+    for (int mode = 0; mode < 512; mode++) {
+        for (int bit = 0; bit < 9; bit++) {
+            permission_table[mode][bit] = (mode & (0400 >> bit)) ? letters[bit] : '-';
+        }
     }
+}
 
-    
-    if ((temporary_mode & S_IROTH) != 0) {
-        perm_string[7] = 'r';
-    } else {
-        perm_string[7] = '-';
-    }
-    if ((temporary_mode & S_IWOTH) != 0) {
-        perm_string[8] = 'w';
-    } else {
-        perm_string[8] = '-';
-    }
-    if ((temporary_mode & S_IXOTH) != 0) {
-        perm_string[9] = 'x';
-    } else {
-        perm_string[9] = '-';
+int determine_permissions(char *perm_string, mode_t mode) {
+    if (perm_string == NULL) {
+        fprintf(stderr, "Error in determine_permissions: Invalid input received\n");
+        return 1;
     }
 
-    
+    perm_string[0] = type_chars[(mode & S_IFMT) >> 12];
+    memcpy(perm_string + 1, permission_table[mode & 0777], 9);
     perm_string[10] = '\0';
 
     return 0;
 }
 
+// Текущее время берётся один раз за запуск, как в ls: иначе граница
+// "полгода" сдвигалась бы во время вывода.
+time_t current_time;
+
 int format_time_string(time_t mod_time, char *time_output) {
+    struct tm local_time;
     struct tm *time_data;
-    time_t current_time;
     double time_difference;
     char temporary_format[20];
     int months_threshold;
 
     
-    time_data = localtime(&mod_time);
+    time_data = localtime_r(&mod_time, &local_time);
     if (time_data == NULL) {
         strcpy(time_output, "Неверная временная метка");
         return 0;
     }
 
     
-    current_time = time(NULL);
     if (current_time == (time_t)-1) {
         strcpy(time_output, "Не удалось получить время");
         return 0;
@@ -159,158 +108,3309 @@ int format_time_string(time_t mod_time, char *time_output) {
     }
 
     
-    strftime(time_output, 20, temporary_format, time_data);
+    strftime(time_output, TIME_TEXT_SIZE, temporary_format, time_data);
 
     return 0;
 }
 
-int get_disk_block(const char *file_path, struct stat *stats) {
-    int file_handle;
-    int block_number;
-    int result_of_ioctl;
+// Кэш отформатированных дат потока обхода. Строка зависит только от минуты
+// mtime и от того, старше ли файл полугода, поэтому localtime_r и strftime
+// вызываются один раз на такую пару. Прямое отображение, коллизия просто
+// перезаписывает ячейку.
+#define DATE_CACHE_SIZE 1024
+
+typedef struct {
+    long long key;              // минута * 2 + "старый", LLONG_MIN - пусто
+    char text[TIME_TEXT_SIZE];
+    size_t length;
+} date_slot;
+
+const date_slot *cached_time_string(date_slot *cache, time_t mod_time) {
+    long long minute = (long long)mod_time / 60 - ((long long)mod_time % 60 < 0);
+    int old = difftime(current_time, mod_time) > 6 * 30 * 24 * 60 * 60;
+    long long key = minute * 2 + old;
+    date_slot *slot = &cache[(size_t)((unsigned long long)key * 2654435761u) & (DATE_CACHE_SIZE - 1)];
+    if (slot->key != key) {
+        format_time_string(mod_time, slot->text);
+        slot->length = strlen(slot->text);
+        slot->key = key;
+    }
+    return slot;
+}
+
+// Экстенты файла через FS_IOC_FIEMAP: первый физический блок, число
+// экстентов и число разрывов между ними. В отличие от FIBMAP не требует
+// CAP_SYS_RAWIO и работает на ext4, xfs и btrfs. Экстенты читаются пачками
+// по FIEMAP_BATCH в буфер потока обхода.
+#define FIEMAP_BATCH 64
+
+typedef struct {
+    long long first_block;      // в блоках ФС, -1 - неизвестен
+    unsigned int extents;
+    unsigned int fragments;     // экстенты, начатые не там, где кончился предыдущий
+} extent_info;
+
+struct fiemap *new_fiemap_buffer() {
+    return malloc(sizeof(struct fiemap) + FIEMAP_BATCH * sizeof(struct fiemap_extent));
+}
+
+int get_extents(struct fiemap *map, int dir_fd, const char *name, const struct stat *stats,
+                extent_info *info) {
+    info->first_block = -1;
+    info->extents = 0;
+    info->fragments = 0;
 
-    
     if (S_ISREG(stats->st_mode) == 0) {
         if (S_ISDIR(stats->st_mode) == 0) {
             return -1;
         }
     }
+    // У пустого файла экстентов нет, открывать его незачем.
+    if (S_ISREG(stats->st_mode) && stats->st_size == 0) {
+        return 0;
+    }
 
-    
-    file_handle = open(file_path, O_RDONLY);
+    int file_handle = openat(dir_fd, name, O_RDONLY | O_CLOEXEC | O_NOCTTY | O_NONBLOCK);
     if (file_handle < 0) {
         return -1;
     }
 
-    
-    block_number = 0;
+    unsigned long long block_size = stats->st_blksize > 0 ? (unsigned long long)stats->st_blksize : 512;
+    unsigned long long next_physical = 0;
+    int contiguous_known = 0;
+    unsigned long long start = 0;
+    while (1) {
+        memset(map, 0, sizeof(struct fiemap));
+        map->fm_start = start;
+        map->fm_length = FIEMAP_MAX_OFFSET - start;
+        map->fm_extent_count = FIEMAP_BATCH;
+        if (ioctl(file_handle, FS_IOC_FIEMAP, map) != 0) {
+            close(file_handle);
+            return -1;
+        }
 
-    
-    result_of_ioctl = ioctl(file_handle, FIBMAP, &block_number);
-    if (result_of_ioctl != 0) {
-        close(file_handle);
-        return -1;
+        int last = map->fm_mapped_extents < FIEMAP_BATCH;
+        for (unsigned int i = 0; i < map->fm_mapped_extents; i++) {
+            struct fiemap_extent *extent = &map->fm_extents[i];
+            // Отложенное выделение: места на диске у экстента ещё нет.
+            int known = (extent->fe_flags & FIEMAP_EXTENT_UNKNOWN) == 0;
+            if (info->extents == 0 && known) {
+                info->first_block = (long long)(extent->fe_physical / block_size);
+            }
+            if (known && contiguous_known && extent->fe_physical != next_physical) {
+                info->fragments++;
+            }
+            contiguous_known = known;
+            next_physical = extent->fe_physical + extent->fe_length;
+            info->extents++;
+            start = extent->fe_logical + extent->fe_length;
+            if (extent->fe_flags & FIEMAP_EXTENT_LAST) {
+                last = 1;
+            }
+        }
+        if (last || map->fm_mapped_extents == 0) {
+            break;
+        }
     }
 
-    
     close(file_handle);
+    return 0;
+}
+
+// Кэш имён пользователей и групп. getpwuid/getgrgid под NSS могут читать
+// /etc/passwd или ходить в sssd/LDAP на каждый вызов, поэтому каждый id
+// разрешается один раз за запуск, включая неизвестные. Открытая адресация,
+// таблица удваивается при заполнении наполовину.
+typedef struct {
+    unsigned int id;
+    char *name;         // NULL - ячейка свободна
+} name_entry;
+
+typedef struct {
+    name_entry *entries;
+    size_t capacity;
+    size_t count;
+} name_cache;
+
+pthread_mutex_t nss_lock = PTHREAD_MUTEX_INITIALIZER;
+
+size_t name_slot(const name_cache *cache, unsigned int id) {
+    size_t slot = (size_t)(id * 2654435761u) & (cache->capacity - 1);
+    while (cache->entries[slot].name && cache->entries[slot].id != id) {
+        slot = (slot + 1) & (cache->capacity - 1);
+    }
+    return slot;
+}
+
+int name_cache_grow(name_cache *cache) {
+    size_t old_capacity = cache->capacity;
+    name_entry *old_entries = cache->entries;
+    size_t capacity = old_capacity ? old_capacity * 2 : 64;
+
+    name_entry *entries = calloc(capacity, sizeof(name_entry));
+    if (!entries) {
+        return 1;
+    }
+    cache->entries = entries;
+    cache->capacity = capacity;
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old_entries[i].name) {
+            cache->entries[name_slot(cache, old_entries[i].id)] = old_entries[i];
+        }
+    }
+    free(old_entries);
+    return 0;
+}
+
+const char *lookup_name(name_cache *cache, unsigned int id, int is_group) {
+    if (cache->capacity) {
+        size_t slot = name_slot(cache, id);
+        if (cache->entries[slot].name) {
+            return cache->entries[slot].name;
+        }
+    }
+
+    // Кэш у каждого потока обхода свой, а getpwuid/getgrgid возвращают
+    // статический буфер, поэтому промахи разрешаются под общей блокировкой.
+    pthread_mutex_lock(&nss_lock);
+    const char *name = NULL;
+    if (is_group) {
+        struct group *group = getgrgid((gid_t)id);
+        name = group ? group->gr_name : NULL;
+    } else {
+        struct passwd *owner = getpwuid((uid_t)id);
+        name = owner ? owner->pw_name : NULL;
+    }
+    char *copy = strdup(name ? name : "unknown");
+    pthread_mutex_unlock(&nss_lock);
+    if (!copy) {
+        return "unknown";
+    }
+    if (2 * (cache->count + 1) > cache->capacity && name_cache_grow(cache) != 0) {
+        free(copy);
+        return "unknown";
+    }
+    size_t slot = name_slot(cache, id);
+    cache->entries[slot].id = id;
+    cache->entries[slot].name = copy;
+    cache->count++;
+    return copy;
+}
+
+void free_name_cache(name_cache *cache) {
+    for (size_t i = 0; i < cache->capacity; i++) {
+        free(cache->entries[i].name);
+    }
+    free(cache->entries);
+    cache->entries = NULL;
+    cache->capacity = 0;
+    cache->count = 0;
+}
+
+// Метаданные одним statx относительно открытого каталога: ядро не разбирает
+// полный путь заново, AT_STATX_DONT_SYNC не заставляет сетевые ФС сверяться
+// с сервером, и запрашиваются только выводимые поля.
+int stat_entry(int dir_fd, const char *name, int flags, struct stat *stats) {
+    struct statx extended;
+    unsigned int mask = STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_UID | STATX_GID |
+                        STATX_SIZE | STATX_MTIME | STATX_CTIME | STATX_INO | STATX_BLOCKS;
+
+    if (statx(dir_fd, name, flags | AT_STATX_DONT_SYNC, mask, &extended) != 0) {
+        if (errno != ENOSYS) {
+            return -1;
+        }
+        return fstatat(dir_fd, name, stats, flags);
+    }
+
+    memset(stats, 0, sizeof(*stats));
+    stats->st_mode = extended.stx_mode;
+    stats->st_nlink = extended.stx_nlink;
+    stats->st_uid = extended.stx_uid;
+    stats->st_gid = extended.stx_gid;
+    stats->st_size = (off_t)extended.stx_size;
+    stats->st_mtim.tv_sec = extended.stx_mtime.tv_sec;
+    stats->st_mtim.tv_nsec = extended.stx_mtime.tv_nsec;
+    stats->st_blksize = (blksize_t)extended.stx_blksize;
+    stats->st_ino = (ino_t)extended.stx_ino;
+    stats->st_dev = makedev(extended.stx_dev_major, extended.stx_dev_minor);
+    stats->st_blocks = (blkcnt_t)extended.stx_blocks;
+    stats->st_ctim.tv_sec = extended.stx_ctime.tv_sec;
+    stats->st_ctim.tv_nsec = extended.stx_ctime.tv_nsec;
+    return 0;
+}
+
+// Буфер вывода одного каталога. Каталоги обходятся параллельно, а печатаются
+// по порядку, поэтому строки копятся здесь, пока не подойдёт очередь каталога.
+typedef struct {
+    char *data;
+    size_t length;
+    size_t capacity;
+} out_buffer;
+
+int out_reserve(out_buffer *out, size_t extra) {
+    if (out->length + extra <= out->capacity) {
+        return 0;
+    }
+    size_t capacity = out->capacity ? out->capacity : 4096;
+    while (capacity < out->length + extra) {
+        capacity *= 2;
+    }
+    char *data = realloc(out->data, capacity);
+    if (!data) {
+        return 1;
+    }
+    out->data = data;
+    out->capacity = capacity;
+    return 0;
+}
+
+int out_printf(out_buffer *out, const char *format, ...) {
+    while (1) {
+        size_t room = out->capacity - out->length;
+        va_list args;
+        va_start(args, format);
+        int written = vsnprintf(out->data ? out->data + out->length : NULL, room, format, args);
+        va_end(args);
+        if (written < 0) {
+            return 1;
+        }
+        if ((size_t)written < room) {
+            out->length += (size_t)written;
+            return 0;
+        }
+        if (out_reserve(out, (size_t)written + 1) != 0) {
+            return 1;
+        }
+    }
+}
+
+// Сборка строк без printf: под строку заранее резервируется место, и поля
+// копируются прямо в буфер.
+char *put_text(char *p, const char *text, size_t length) {
+    memcpy(p, text, length);
+    return p + length;
+}
+
+// Как printf("%*llu"/"%*lld"): число выравнивается пробелами вправо.
+char *put_number(char *p, long long value, int is_signed, int width) {
+    char digits[24];
+    int count = 0;
+    int negative = is_signed && value < 0;
+    unsigned long long magnitude = negative ? 0ULL - (unsigned long long)value : (unsigned long long)value;
+    do {
+        digits[count++] = (char)('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude);
+    for (int pad = width - count - negative; pad > 0; pad--) {
+        *p++ = ' ';
+    }
+    if (negative) {
+        *p++ = '-';
+    }
+    while (count) {
+        *p++ = digits[--count];
+    }
+    return p;
+}
+
+// Вывод копится в одном большом буфере и уходит в stdout редкими write:
+// в канал каждая запись - это отдельное пробуждение читателя. Буферы
+// больших каталогов пишутся напрямую, без копирования.
+#define OUTPUT_BUFFER_SIZE (1024 * 1024)
+#define STREAM_CHUNK (256 * 1024)
 
-    return block_number;
+char output_buffer[OUTPUT_BUFFER_SIZE];
+size_t output_length = 0;
+
+int write_all(const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(STDOUT_FILENO, data, length);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return 1;
+        }
+        data += written;
+        length -= (size_t)written;
+    }
+    return 0;
+}
+
+int flush_output() {
+    int status = write_all(output_buffer, output_length);
+    output_length = 0;
+    return status;
+}
+
+// Большой кусок пишется мимо буфера, но только после накопленного в нём.
+int emit_bytes(const char *data, size_t length) {
+    int direct = length >= OUTPUT_BUFFER_SIZE / 4;
+    if ((direct || output_length + length > OUTPUT_BUFFER_SIZE) && flush_output() != 0) {
+        return 1;
+    }
+    if (direct) {
+        return write_all(data, length);
+    }
+    memcpy(output_buffer + output_length, data, length);
+    output_length += length;
+    return 0;
+}
+
+// Узел дерева обхода - один каталог. Подкаталог открывается через openat
+// относительно дескриптора родителя, так что родитель держит свой дескриптор,
+// пока все его подкаталоги не откроются.
+typedef struct dir_node {
+    char *path;                     // только для вывода
+    const char *name;               // внутри path, относительно parent->fd
+    struct dir_node *parent;
+    int fd;
+    atomic_int fd_users;            // сам обход + ещё не открытые подкаталоги
+    out_buffer out;
+    out_buffer snap;                // запись каталога для --snapshot
+    struct dir_node **children;     // подкаталоги в порядке вывода
+    size_t child_count;
+    int failed;
+    atomic_int done;                // out и children готовы, под emit_lock
+    atomic_int streaming;           // вывод дошёл до каталога, out можно сливать сразу
+    long long du_blocks;            // --du: свои файлы, после обхода - всё поддерево
+    long long du_size;
+    long long du_files;
+} dir_node;
+
+// Компактная запись каталога. Записи каталога лежат в одном массиве потока
+// обхода, который переиспользуется от каталога к каталогу, имена - в общем
+// пуле, так что на запись не приходится ни одного malloc.
+typedef struct {
+    size_t name;                    // смещение в пуле имён
+    uint64_t ino;
+    int64_t size;
+    int64_t mtime;
+    int64_t ctime;
+    int64_t first_block;
+    uint32_t mtime_nsec;
+    uint32_t ctime_nsec;
+    uint32_t mode;
+    uint32_t nlink;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t extents;
+    uint32_t fragments;
+    uint8_t type;                   // d_type из getdents64
+    uint8_t flags;
+} dir_entry;
+
+#define ENTRY_HIDDEN 1              // отброшена фильтром --min-frag
+
+typedef struct {
+    uint64_t key;
+    size_t index;
+} sort_key;
+
+enum sort_order {
+    SORT_NAME,
+    SORT_SIZE,
+    SORT_TIME,
+    SORT_NONE
+};
+
+enum output_format {
+    FORMAT_TEXT,
+    FORMAT_JSONL,
+    FORMAT_BINARY
+};
+
+enum entry_change {
+    CHANGE_NONE,
+    CHANGE_ADDED,
+    CHANGE_REMOVED,
+    CHANGE_CHANGED
+};
+
+const char change_marks[] = " +-~";
+const char *const change_names[] = {"", "added", "removed", "changed"};
+
+// Каталоги ждут в деках потоков: свой дек поток разбирает снизу (только что
+// найденные подкаталоги, обход почти в глубину), а простаивающий поток
+// забирает каталог сверху у случайного соседа.
+typedef struct {
+    alignas(64) pthread_mutex_t lock;
+    dir_node **items;               // кольцевой буфер
+    size_t top;
+    size_t bottom;
+    size_t capacity;
+    unsigned long steals;
+} node_deque;
+
+// Размер 0 и по корзине на каждую степень двойки.
+#define SIZE_BUCKETS 65
+
+typedef struct {
+    long long size;
+    char *path;
+} top_file;
+
+typedef struct {
+    pthread_t thread;
+    int id;
+    int next_victim;                // у кого пробовать красть в следующий раз
+    char *dents;                    // буфер getdents64
+    struct fiemap *fiemap;
+    dir_entry *entries;
+    size_t entry_capacity;
+    char *names;
+    size_t names_length;
+    size_t names_capacity;
+    sort_key *keys;
+    sort_key *scratch;
+    size_t key_capacity;
+    name_cache user_names;
+    name_cache group_names;
+    date_slot dates[DATE_CACHE_SIZE];
+    top_file *top;                  // --du: куча крупнейших файлов
+    size_t top_count;
+    uint64_t size_counts[SIZE_BUCKETS];
+    uint64_t size_bytes[SIZE_BUCKETS];
+} walker;
+
+// Формат записи ядра для getdents64 (в заголовках glibc её нет).
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+#define DENTS_BUFFER_SIZE (64 * 1024)
+
+int recursive = 0;
+int jobs = 0;
+int show_blocks = 1;
+int show_extents = 0;
+unsigned int min_fragments = 0;     // 0 - без фильтра
+enum sort_order sort_by = SORT_NAME;
+enum output_format output_format = FORMAT_TEXT;
+int du_mode = 0;
+size_t top_limit = 10;
+walker *walkers;
+node_deque *node_deques;
+atomic_long dirs_pending;           // каталоги в деках и в обработке
+atomic_int stop_walk;               // вывод прерван, остальное не сканируется
+pthread_mutex_t emit_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t emit_cond = PTHREAD_COND_INITIALIZER;
+
+// Ширины колонок каталога считаются по ходу первого прохода, как в ls.
+typedef struct {
+    int nlink;
+    int owner;
+    int group;
+    int size;
+    int block;
+    int extents;
+    int fragments;
+} column_widths;
+
+int number_width(long long value) {
+    int width = value < 0 ? 2 : 1;
+    unsigned long long magnitude = value < 0 ? 0ULL - (unsigned long long)value : (unsigned long long)value;
+    while (magnitude >= 10) {
+        magnitude /= 10;
+        width++;
+    }
+    return width;
 }
 
-int process_file(const char *file_path) {
+void widen(int *width, int value) {
+    if (value > *width) {
+        *width = value;
+    }
+}
+
+// Заполняет запись по уже полученным метаданным и расширяет колонки.
+void fill_entry(walker *w, int dir_fd, const char *name, const struct stat *file_stats,
+                dir_entry *entry, column_widths *widths) {
+    extent_info extents = {-1, 0, 0};
+    if (show_blocks) {
+        get_extents(w->fiemap, dir_fd, name, file_stats, &extents);
+    }
+
+    entry->ino = (uint64_t)file_stats->st_ino;
+    entry->ctime = (int64_t)file_stats->st_ctim.tv_sec;
+    entry->ctime_nsec = (uint32_t)file_stats->st_ctim.tv_nsec;
+    entry->size = (int64_t)file_stats->st_size;
+    entry->mtime = (int64_t)file_stats->st_mtim.tv_sec;
+    entry->mtime_nsec = (uint32_t)file_stats->st_mtim.tv_nsec;
+    entry->first_block = extents.first_block;
+    entry->mode = (uint32_t)file_stats->st_mode;
+    entry->nlink = (uint32_t)file_stats->st_nlink;
+    entry->uid = (uint32_t)file_stats->st_uid;
+    entry->gid = (uint32_t)file_stats->st_gid;
+    entry->extents = extents.extents;
+    entry->fragments = extents.fragments;
+    entry->flags = 0;
+    if (min_fragments > 0 && (!S_ISREG(file_stats->st_mode) || extents.fragments < min_fragments)) {
+        entry->flags |= ENTRY_HIDDEN;
+        return;
+    }
+
+    widen(&widths->nlink, number_width(entry->nlink));
+    widen(&widths->owner, (int)strlen(lookup_name(&w->user_names, entry->uid, 0)));
+    widen(&widths->group, (int)strlen(lookup_name(&w->group_names, entry->gid, 1)));
+    widen(&widths->size, number_width(entry->size));
+    widen(&widths->block, number_width(entry->first_block));
+    widen(&widths->extents, number_width(entry->extents));
+    widen(&widths->fragments, number_width(entry->fragments));
+}
+
+// Первый проход: метаданные записи в компактную запись и ширины колонок.
+int process_file(walker *w, int dir_fd, const char *folder_path, const char *name,
+                 dir_entry *entry, column_widths *widths) {
     struct stat file_stats;
 
-    if (!file_path) {
+    if (!folder_path || !name) {
         fprintf(stderr, "Ошибка в process_file: путь к файлу не указан\n");
         return 1;
     }
 
-    if (stat(file_path, &file_stats) != 0) {
+    if (stat_entry(dir_fd, name, 0, &file_stats) != 0) {
         fprintf(stderr, "Ошибка в process_file: не удалось получить информацию о файле\n");
         return 1;
     }
+    fill_entry(w, dir_fd, name, &file_stats, entry, widths);
+    return 0;
+}
+
+char *put_padded(char *p, const char *text, size_t length, int width) {
+    p = put_text(p, text, length);
+    for (int pad = width - (int)length; pad > 0; pad--) {
+        *p++ = ' ';
+    }
+    return p;
+}
 
+// Второй проход: строка записи в буфер вывода каталога.
+int format_text_entry(walker *w, out_buffer *out, const char *folder_path, size_t folder_length,
+                      const char *name, const dir_entry *entry, const column_widths *widths,
+                      enum entry_change change) {
     char permissions[11];
-    if (determine_permissions(permissions, &file_stats) != 0) {
+    if (determine_permissions(permissions, entry->mode) != 0) {
         return 1;
     }
 
-    struct passwd *owner = getpwuid(file_stats.st_uid);
-    struct group *group = getgrgid(file_stats.st_gid);
-    char *owner_name = owner ? owner->pw_name : "unknown";
-    char *group_name = group ? group->gr_name : "unknown";
-
-    char time_buffer[20];
-    format_time_string(file_stats.st_mtime, time_buffer);
-
-    int block_number = get_disk_block(file_path, &file_stats);
+    const char *owner_name = lookup_name(&w->user_names, entry->uid, 0);
+    const char *group_name = lookup_name(&w->group_names, entry->gid, 1);
+    const date_slot *date = cached_time_string(w->dates, (time_t)entry->mtime);
 
-    
     const char *color = COLOR_RESET;
-    if (S_ISDIR(file_stats.st_mode)) {
+    if (S_ISDIR(entry->mode)) {
         color = COLOR_BLUE;
-    } else if (S_ISLNK(file_stats.st_mode)) {
+    } else if (S_ISLNK(entry->mode)) {
         color = COLOR_CYAN;
-    } else if (S_ISFIFO(file_stats.st_mode)) {
+    } else if (S_ISFIFO(entry->mode)) {
         color = COLOR_YELLOW;
-    } else if (S_ISCHR(file_stats.st_mode)) {
+    } else if (S_ISCHR(entry->mode)) {
         color = COLOR_MAGENTA;
-    } else if (S_ISBLK(file_stats.st_mode)) {
+    } else if (S_ISBLK(entry->mode)) {
         color = COLOR_MAGENTA;
-    } else if (S_ISSOCK(file_stats.st_mode)) {
+    } else if (S_ISSOCK(entry->mode)) {
         color = COLOR_GREEN;
-    } else if (file_stats.st_mode & S_IXUSR) {
+    } else if (entry->mode & S_IXUSR) {
         color = COLOR_RED;
     }
 
-    printf("%s %2lu %s %s %6lu %s %d %s%s%s\n",
-           permissions, (unsigned long)file_stats.st_nlink, owner_name, group_name,
-           (unsigned long)file_stats.st_size, time_buffer, block_number, color, file_path, COLOR_RESET);
+    size_t owner_length = strlen(owner_name);
+    size_t group_length = strlen(group_name);
+    size_t name_length = strlen(name);
+    size_t color_length = strlen(color);
+    // Числовые поля и пробелы между ними укладываются в 128 байт. Имя
+    // владельца или группы может быть длиннее колонки: при --diff ширины
+    // нулевые, и put_padded всё равно пишет имя целиком.
+    size_t owner_field = owner_length > (size_t)widths->owner ? owner_length : (size_t)widths->owner;
+    size_t group_field = group_length > (size_t)widths->group ? group_length : (size_t)widths->group;
+    if (out_reserve(out, 128 + owner_field + group_field + date->length + color_length +
+                         folder_length + name_length + sizeof(COLOR_RESET)) != 0) {
+        fprintf(stderr, "Ошибка в process_file: не удалось выделить память\n");
+        return 1;
+    }
+
+    char *p = out->data + out->length;
+    if (change != CHANGE_NONE) {
+        *p++ = change_marks[change];
+        *p++ = ' ';
+    }
+    p = put_text(p, permissions, 10);
+    *p++ = ' ';
+    p = put_number(p, entry->nlink, 0, widths->nlink);
+    *p++ = ' ';
+    p = put_padded(p, owner_name, owner_length, widths->owner);
+    *p++ = ' ';
+    p = put_padded(p, group_name, group_length, widths->group);
+    *p++ = ' ';
+    p = put_number(p, entry->size, 0, widths->size);
+    *p++ = ' ';
+    p = put_text(p, date->text, date->length);
+    *p++ = ' ';
+    if (!show_blocks) {
+        *p++ = '-';
+    } else {
+        p = put_number(p, entry->first_block, 1, widths->block);
+        if (show_extents) {
+            *p++ = ' ';
+            p = put_number(p, entry->extents, 0, widths->extents);
+            *p++ = ' ';
+            p = put_number(p, entry->fragments, 0, widths->fragments);
+        }
+    }
+    *p++ = ' ';
+    p = put_text(p, color, color_length);
+    p = put_text(p, folder_path, folder_length);
+    *p++ = '/';
+    p = put_text(p, name, name_length);
+    p = put_text(p, COLOR_RESET, sizeof(COLOR_RESET) - 1);
+    *p++ = '\n';
+    out->length = (size_t)(p - out->data);
+
+    return 0;
+}
+
+// Строка JSON. Байты, которые не складываются в UTF-8, пишутся как
+// \udc80-\udcff (как surrogateescape в Python), так что путь восстановим
+// побайтно. Нужно до 6 байт на входной байт. Кавычки ставит вызывающий.
+char *put_json_chars(char *p, const char *text, size_t length) {
+    static const char hex[] = "0123456789abcdef";
+    const unsigned char *bytes = (const unsigned char *)text;
+    for (size_t i = 0; i < length;) {
+        unsigned char c = bytes[i];
+        if (c == '"' || c == '\\') {
+            *p++ = '\\';
+            *p++ = (char)c;
+            i++;
+            continue;
+        }
+        if (c < 0x20) {
+            p = put_text(p, "\\u00", 4);
+            *p++ = hex[c >> 4];
+            *p++ = hex[c & 15];
+            i++;
+            continue;
+        }
+        if (c < 0x80) {
+            *p++ = (char)c;
+            i++;
+            continue;
+        }
+
+        // Длина последовательности UTF-8 и допустимый диапазон второго
+        // байта: без избыточных кодировок, суррогатов и выше U+10FFFF.
+        size_t sequence = 0;
+        unsigned char low = 0x80;
+        unsigned char high = 0xbf;
+        if (c >= 0xc2 && c <= 0xdf) {
+            sequence = 2;
+        } else if (c >= 0xe0 && c <= 0xef) {
+            sequence = 3;
+            low = c == 0xe0 ? 0xa0 : 0x80;
+            high = c == 0xed ? 0x9f : 0xbf;
+        } else if (c >= 0xf0 && c <= 0xf4) {
+            sequence = 4;
+            low = c == 0xf0 ? 0x90 : 0x80;
+            high = c == 0xf4 ? 0x8f : 0xbf;
+        }
+        int valid = sequence > 0 && i + sequence <= length && bytes[i + 1] >= low && bytes[i + 1] <= high;
+        for (size_t k = 2; valid && k < sequence; k++) {
+            valid = bytes[i + k] >= 0x80 && bytes[i + k] <= 0xbf;
+        }
+        if (valid) {
+            p = put_text(p, text + i, sequence);
+            i += sequence;
+        } else {
+            p = put_text(p, "\\udc", 4);
+            *p++ = hex[c >> 4];
+            *p++ = hex[c & 15];
+            i++;
+        }
+    }
+    return p;
+}
+
+char *put_json_string(char *p, const char *text, size_t length) {
+    *p++ = '"';
+    p = put_json_chars(p, text, length);
+    *p++ = '"';
+    return p;
+}
+
+// Одна запись - один объект JSON в строке, без заголовков каталогов и цвета.
+int format_jsonl_entry(walker *w, out_buffer *out, const char *folder_path, size_t folder_length,
+                       const char *name, const dir_entry *entry, enum entry_change change) {
+    const char *owner_name = lookup_name(&w->user_names, entry->uid, 0);
+    const char *group_name = lookup_name(&w->group_names, entry->gid, 1);
+    size_t owner_length = strlen(owner_name);
+    size_t group_length = strlen(group_name);
+    size_t name_length = strlen(name);
+    // Имена полей и числа укладываются в 256 байт.
+    if (out_reserve(out, 256 + 6 * (owner_length + group_length + folder_length + 1 + name_length)) != 0) {
+        fprintf(stderr, "Ошибка в process_file: не удалось выделить память\n");
+        return 1;
+    }
 
+    char *p = out->data + out->length;
+    *p++ = '{';
+    if (change != CHANGE_NONE) {
+        p = put_text(p, "\"change\":\"", 10);
+        p = put_text(p, change_names[change], strlen(change_names[change]));
+        p = put_text(p, "\",", 2);
+    }
+    p = put_text(p, "\"mode\":", 7);
+    p = put_number(p, entry->mode, 0, 0);
+    p = put_text(p, ",\"nlink\":", 9);
+    p = put_number(p, entry->nlink, 0, 0);
+    p = put_text(p, ",\"owner\":", 9);
+    p = put_json_string(p, owner_name, owner_length);
+    p = put_text(p, ",\"group\":", 9);
+    p = put_json_string(p, group_name, group_length);
+    p = put_text(p, ",\"size\":", 8);
+    p = put_number(p, entry->size, 1, 0);
+    p = put_text(p, ",\"mtime\":", 9);
+    p = put_number(p, entry->mtime, 1, 0);
+    p = put_text(p, ",\"mtime_nsec\":", 14);
+    p = put_number(p, entry->mtime_nsec, 0, 0);
+    if (show_blocks) {
+        p = put_text(p, ",\"block\":", 9);
+        p = put_number(p, entry->first_block, 1, 0);
+        if (show_extents) {
+            p = put_text(p, ",\"extents\":", 11);
+            p = put_number(p, entry->extents, 0, 0);
+            p = put_text(p, ",\"fragments\":", 13);
+            p = put_number(p, entry->fragments, 0, 0);
+        }
+    }
+    p = put_text(p, ",\"path\":\"", 9);
+    p = put_json_chars(p, folder_path, folder_length);
+    *p++ = '/';
+    p = put_json_chars(p, name, name_length);
+    p = put_text(p, "\"}\n", 3);
+    out->length = (size_t)(p - out->data);
     return 0;
 }
 
-int explore_directory(const char *folder_path) {
-    if (!folder_path) {
-        fprintf(stderr, "Ошибка в explore_directory: неверный путь к каталогу\n");
+// Двоичный формат для приёма без разбора. Поток начинается с магии
+// "LSTB" и номера версии, дальше записи подряд: заголовок binary_record в
+// порядке байтов машины, за ним байты владельца, группы и пути без нулей,
+// дополненные нулями до кратного 8. record_length - полная длина записи,
+// по нему читатель переходит к следующей.
+#define BINARY_MAGIC "LSTB"
+#define BINARY_VERSION 1
+
+typedef struct {
+    uint32_t record_length;
+    uint32_t mode;
+    int64_t size;
+    int64_t mtime;
+    int64_t first_block;            // -1 - неизвестен или --no-blocks
+    uint32_t mtime_nsec;
+    uint32_t nlink;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t extents;
+    uint32_t fragments;
+    uint16_t owner_length;
+    uint16_t group_length;
+    uint32_t path_length;
+} binary_record;
+
+_Static_assert(sizeof(binary_record) == 64, "binary_record layout is part of the format");
+
+int format_binary_entry(walker *w, out_buffer *out, const char *folder_path, size_t folder_length,
+                        const char *name, const dir_entry *entry) {
+    const char *owner_name = lookup_name(&w->user_names, entry->uid, 0);
+    const char *group_name = lookup_name(&w->group_names, entry->gid, 1);
+    size_t owner_length = strnlen(owner_name, UINT16_MAX);
+    size_t group_length = strnlen(group_name, UINT16_MAX);
+    size_t path_length = folder_length + 1 + strlen(name);
+    size_t length = (sizeof(binary_record) + owner_length + group_length + path_length + 7) & ~(size_t)7;
+    if (length > UINT32_MAX || out_reserve(out, length) != 0) {
+        fprintf(stderr, "Ошибка в process_file: не удалось выделить память\n");
         return 1;
     }
 
-    DIR *directory = opendir(folder_path);
-    if (!directory) {
-        fprintf(stderr, "Ошибка в explore_directory: не удалось получить доступ к каталогу\n");
+    binary_record record = {
+        .record_length = (uint32_t)length,
+        .mode = entry->mode,
+        .size = entry->size,
+        .mtime = entry->mtime,
+        .first_block = show_blocks ? entry->first_block : -1,
+        .mtime_nsec = entry->mtime_nsec,
+        .nlink = entry->nlink,
+        .uid = entry->uid,
+        .gid = entry->gid,
+        .extents = entry->extents,
+        .fragments = entry->fragments,
+        .owner_length = (uint16_t)owner_length,
+        .group_length = (uint16_t)group_length,
+        .path_length = (uint32_t)path_length
+    };
+    char *start = out->data + out->length;
+    char *p = put_text(start, (const char *)&record, sizeof(record));
+    p = put_text(p, owner_name, owner_length);
+    p = put_text(p, group_name, group_length);
+    p = put_text(p, folder_path, folder_length);
+    *p++ = '/';
+    p = put_text(p, name, path_length - folder_length - 1);
+    memset(p, 0, (size_t)(start + length - p));
+    out->length += length;
+    return 0;
+}
+
+// change - пометка для --diff, CHANGE_NONE в обычном выводе.
+int format_entry(walker *w, out_buffer *out, const char *folder_path, size_t folder_length,
+                 const char *name, const dir_entry *entry, const column_widths *widths,
+                 enum entry_change change) {
+    switch (output_format) {
+        case FORMAT_JSONL:
+            return format_jsonl_entry(w, out, folder_path, folder_length, name, entry, change);
+        case FORMAT_BINARY:
+            return format_binary_entry(w, out, folder_path, folder_length, name, entry);
+        default:
+            return format_text_entry(w, out, folder_path, folder_length, name, entry, widths, change);
+    }
+}
+
+int deque_grow(node_deque *deque) {
+    size_t capacity = deque->capacity ? deque->capacity * 2 : 64;
+    dir_node **items = malloc(capacity * sizeof(dir_node *));
+    if (!items) {
         return 1;
     }
+    size_t count = deque->bottom - deque->top;
+    for (size_t i = 0; i < count; i++) {
+        items[i] = deque->items[(deque->top + i) % deque->capacity];
+    }
+    free(deque->items);
+    deque->items = items;
+    deque->top = 0;
+    deque->bottom = count;
+    deque->capacity = capacity;
+    return 0;
+}
 
-    printf("Содержимое каталога: %s\n", folder_path);
-    struct dirent *entry;
-    char *full_path = NULL;
+int deque_push(node_deque *deque, dir_node *node) {
+    int status = 0;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom - deque->top == deque->capacity && deque_grow(deque) != 0) {
+        status = 1;
+    } else {
+        deque->items[deque->bottom++ % deque->capacity] = node;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return status;
+}
 
-    while ((entry = readdir(directory)) != NULL) {
-        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) {
-            continue;
+dir_node *deque_pop(node_deque *deque, int from_top) {
+    dir_node *node = NULL;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom != deque->top) {
+        if (from_top) {
+            node = deque->items[deque->top++ % deque->capacity];
+        } else {
+            node = deque->items[--deque->bottom % deque->capacity];
         }
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return node;
+}
+
+void release_fd(dir_node *node) {
+    if (atomic_fetch_sub(&node->fd_users, 1) == 1 && node->fd >= 0) {
+        close(node->fd);
+        node->fd = -1;
+    }
+}
+
+dir_node *new_node(dir_node *parent, const char *path, const char *name) {
+    dir_node *node = calloc(1, sizeof(dir_node));
+    if (!node) {
+        return NULL;
+    }
+    size_t path_length = strlen(path);
+    size_t name_length = name ? strlen(name) : 0;
+    node->path = malloc(path_length + name_length + 2);
+    if (!node->path) {
+        free(node);
+        return NULL;
+    }
+    memcpy(node->path, path, path_length);
+    if (name) {
+        node->path[path_length] = '/';
+        memcpy(node->path + path_length + 1, name, name_length + 1);
+        node->name = node->path + path_length + 1;
+    } else {
+        node->path[path_length] = '\0';
+        node->name = node->path;
+    }
+    node->parent = parent;
+    node->fd = -1;
+    atomic_init(&node->fd_users, 1);
+    atomic_init(&node->done, 0);
+    atomic_init(&node->streaming, 0);
+    return node;
+}
+
+void free_node(dir_node *node) {
+    free(node->out.data);
+    free(node->snap.data);
+    free(node->children);
+    free(node->path);
+    free(node);
+}
+
+int open_node(dir_node *node) {
+    if (!node->parent) {
+        node->fd = open(node->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    } else {
+        node->fd = openat(node->parent->fd, node->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        release_fd(node->parent);
+    }
+    return node->fd < 0;
+}
 
-        size_t path_len = strlen(folder_path) + strlen(entry->d_name) + 2;
-        full_path = realloc(full_path, path_len);
-        
-        if (!full_path) {
-            fprintf(stderr, "Ошибка: не удалось выделить память для пути\n");
-            closedir(directory);
+// Читает все записи каталога, кроме . и .., в w->entries и пул имён.
+int read_entries(walker *w, int fd, size_t *count) {
+    *count = 0;
+    w->names_length = 0;
+    while (1) {
+        long length = syscall(SYS_getdents64, fd, w->dents, DENTS_BUFFER_SIZE);
+        if (length < 0) {
             return 1;
         }
+        if (length == 0) {
+            return 0;
+        }
+        for (long offset = 0; offset < length;) {
+            struct linux_dirent64 *record = (struct linux_dirent64 *)(w->dents + offset);
+            offset += record->d_reclen;
+            const char *name = record->d_name;
+            if (!strcmp(name, ".") || !strcmp(name, "..")) {
+                continue;
+            }
 
-        
-        snprintf(full_path, path_len, "%s/%s", folder_path, entry->d_name);
-        
-        if (process_file(full_path) != 0) {
-            free(full_path);
-            closedir(directory);
-            return 1;
+            size_t name_size = strlen(name) + 1;
+            if (*count == w->entry_capacity) {
+                size_t capacity = w->entry_capacity ? w->entry_capacity * 2 : 256;
+                dir_entry *entries = realloc(w->entries, capacity * sizeof(dir_entry));
+                if (!entries) {
+                    return 1;
+                }
+                w->entries = entries;
+                w->entry_capacity = capacity;
+            }
+            if (w->names_length + name_size > w->names_capacity) {
+                size_t capacity = w->names_capacity ? w->names_capacity * 2 : 16384;
+                while (capacity < w->names_length + name_size) {
+                    capacity *= 2;
+                }
+                char *names = realloc(w->names, capacity);
+                if (!names) {
+                    return 1;
+                }
+                w->names = names;
+                w->names_capacity = capacity;
+            }
+            memcpy(w->names + w->names_length, name, name_size);
+            w->entries[*count].name = w->names_length;
+            w->entries[*count].type = record->d_type;
+            w->names_length += name_size;
+            (*count)++;
         }
     }
+}
 
-    
-    free(full_path);
-    closedir(directory);
-    return 0;
+// Сортировка идёт по парам (ключ, номер записи), а не по самим записям:
+// 16 байт на элемент вместо 64. По имени ключ - восемь байт имени после
+// общего для всего каталога начала (file_0001, file_0002, ...), старшими
+// вперёд, так что strcmp нужен только при равных ключах;
+// introsort (quicksort с медианой трёх, heapsort при глубокой рекурсии,
+// вставки на коротких отрезках). Размер и время досортировываются
+// устойчивой LSD-поразрядной сортировкой поверх порядка по имени, так что
+// равные остаются по имени, как в ls.
+// Каждый байт сразу ставится на своё место: пустой остаток имени (имя
+// равно общему началу) даёт ключ 0 без сдвига на 64.
+uint64_t name_prefix(const char *name) {
+    uint64_t key = 0;
+    for (int i = 0; i < 8 && name[i]; i++) {
+        key |= (uint64_t)(unsigned char)name[i] << (56 - 8 * i);
+    }
+    return key;
 }
 
-int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        fprintf(stderr, "Использование: %s <каталог1> [каталог2 ...]\n", argv[0]);
-        return 1;
+int key_less(const sort_key *a, const sort_key *b, const char *names, const dir_entry *entries) {
+    if (a->key != b->key) {
+        return a->key < b->key;
     }
+    return strcmp(names + entries[a->index].name, names + entries[b->index].name) < 0;
+}
 
-    for (int i = 1; i < argc; i++) {
-        if (explore_directory(argv[i]) != 0) {
-            return 1;
-        }
-        if (i < argc - 1) {
-            printf("\n");
+void swap_keys(sort_key *a, sort_key *b) {
+    sort_key temporary = *a;
+    *a = *b;
+    *b = temporary;
+}
+
+void insertion_sort(sort_key *keys, size_t count, const char *names, const dir_entry *entries) {
+    for (size_t i = 1; i < count; i++) {
+        sort_key current = keys[i];
+        size_t j = i;
+        while (j > 0 && key_less(&current, &keys[j - 1], names, entries)) {
+            keys[j] = keys[j - 1];
+            j--;
         }
+        keys[j] = current;
     }
+}
 
-    return 0;
+void sift_down(sort_key *keys, size_t root, size_t count, const char *names, const dir_entry *entries) {
+    while (2 * root + 1 < count) {
+        size_t child = 2 * root + 1;
+        if (child + 1 < count && key_less(&keys[child], &keys[child + 1], names, entries)) {
+            child++;
+        }
+        if (!key_less(&keys[root], &keys[child], names, entries)) {
+            return;
+        }
+        swap_keys(&keys[root], &keys[child]);
+        root = child;
+    }
+}
+
+void heap_sort(sort_key *keys, size_t count, const char *names, const dir_entry *entries) {
+    for (size_t i = count / 2; i-- > 0;) {
+        sift_down(keys, i, count, names, entries);
+    }
+    for (size_t end = count; end-- > 1;) {
+        swap_keys(&keys[0], &keys[end]);
+        sift_down(keys, 0, end, names, entries);
+    }
+}
+
+void introsort(sort_key *keys, size_t count, int depth, const char *names, const dir_entry *entries) {
+    while (count > 16) {
+        if (depth-- == 0) {
+            heap_sort(keys, count, names, entries);
+            return;
+        }
+        size_t middle = count / 2;
+        if (key_less(&keys[middle], &keys[0], names, entries)) {
+            swap_keys(&keys[middle], &keys[0]);
+        }
+        if (key_less(&keys[count - 1], &keys[middle], names, entries)) {
+            swap_keys(&keys[count - 1], &keys[middle]);
+            if (key_less(&keys[middle], &keys[0], names, entries)) {
+                swap_keys(&keys[middle], &keys[0]);
+            }
+        }
+        sort_key pivot = keys[middle];
+
+        // Разбиение Хоара: [0, j] не больше опорного, [j + 1, count) не меньше.
+        size_t i = 0;
+        size_t j = count - 1;
+        while (1) {
+            while (key_less(&keys[i], &pivot, names, entries)) {
+                i++;
+            }
+            while (key_less(&pivot, &keys[j], names, entries)) {
+                j--;
+            }
+            if (i >= j) {
+                break;
+            }
+            swap_keys(&keys[i], &keys[j]);
+            i++;
+            j--;
+        }
+
+        // Меньшая часть - рекурсией, большая - в цикле: стек O(log n).
+        size_t left = j + 1;
+        if (left < count - left) {
+            introsort(keys, left, depth, names, entries);
+            keys += left;
+            count -= left;
+        } else {
+            introsort(keys + left, count - left, depth, names, entries);
+            count = left;
+        }
+    }
+    insertion_sort(keys, count, names, entries);
+}
+
+// Устойчивая сортировка по key, байт за байтом от младшего. Байты, общие
+// для всех ключей (старшие байты размеров), пропускаются.
+void radix_sort(sort_key *keys, sort_key *scratch, size_t count) {
+    sort_key *from = keys;
+    sort_key *to = scratch;
+    for (int shift = 0; shift < 64; shift += 8) {
+        size_t counts[256] = {0};
+        for (size_t i = 0; i < count; i++) {
+            counts[(from[i].key >> shift) & 0xff]++;
+        }
+        if (counts[(from[0].key >> shift) & 0xff] == count) {
+            continue;
+        }
+        size_t offset = 0;
+        for (int digit = 0; digit < 256; digit++) {
+            size_t digit_count = counts[digit];
+            counts[digit] = offset;
+            offset += digit_count;
+        }
+        for (size_t i = 0; i < count; i++) {
+            to[counts[(from[i].key >> shift) & 0xff]++] = from[i];
+        }
+        sort_key *temporary = from;
+        from = to;
+        to = temporary;
+    }
+    if (from != keys) {
+        memcpy(keys, from, count * sizeof(sort_key));
+    }
+}
+
+// Ключ времени: секунды со сдвигом и наносекунды в одном uint64_t, новые
+// первыми. Даты дальше 2242 года прижимаются к краю.
+uint64_t time_key(const dir_entry *entry) {
+    int64_t seconds = entry->mtime;
+    const int64_t limit = (int64_t)1 << 33;
+    if (seconds < -limit) {
+        seconds = -limit;
+    } else if (seconds >= limit) {
+        seconds = limit - 1;
+    }
+    return ~((uint64_t)(seconds + limit) << 30 | entry->mtime_nsec);
+}
+
+// Заполняет w->keys порядком вывода первых count записей.
+int sort_entries(walker *w, size_t count) {
+    if (count > w->key_capacity) {
+        sort_key *keys = realloc(w->keys, count * sizeof(sort_key));
+        if (!keys) {
+            return 1;
+        }
+        w->keys = keys;
+        sort_key *scratch = realloc(w->scratch, count * sizeof(sort_key));
+        if (!scratch) {
+            return 1;
+        }
+        w->scratch = scratch;
+        w->key_capacity = count;
+    }
+    if (sort_by == SORT_NONE || count < 2) {
+        for (size_t i = 0; i < count; i++) {
+            w->keys[i].index = i;
+        }
+        return 0;
+    }
+
+    // Общее начало имён: сравнения начинаются сразу после него.
+    const char *first = w->names + w->entries[0].name;
+    size_t common = strlen(first);
+    for (size_t i = 1; i < count && common > 0; i++) {
+        const char *name = w->names + w->entries[i].name;
+        size_t length = 0;
+        while (length < common && name[length] == first[length]) {
+            length++;
+        }
+        common = length;
+    }
+    const char *names = w->names + common;
+    for (size_t i = 0; i < count; i++) {
+        w->keys[i].key = name_prefix(names + w->entries[i].name);
+        w->keys[i].index = i;
+    }
+
+    int depth = 0;
+    for (size_t n = count; n > 1; n >>= 1) {
+        depth += 2;
+    }
+    introsort(w->keys, count, depth, names, w->entries);
+    if (sort_by == SORT_NAME) {
+        return 0;
+    }
+    for (size_t i = 0; i < count; i++) {
+        const dir_entry *entry = &w->entries[w->keys[i].index];
+        w->keys[i].key = sort_by == SORT_SIZE ? ~(uint64_t)entry->size : time_key(entry);
+    }
+    radix_sort(w->keys, w->scratch, count);
+    return 0;
+}
+
+int add_child(dir_node *node, size_t *child_capacity, const char *name) {
+    if (node->child_count == *child_capacity) {
+        size_t capacity = *child_capacity ? *child_capacity * 2 : 8;
+        dir_node **children = realloc(node->children, capacity * sizeof(dir_node *));
+        if (!children) {
+            return 1;
+        }
+        node->children = children;
+        *child_capacity = capacity;
+    }
+    dir_node *child = new_node(node, node->path, name);
+    if (!child) {
+        return 1;
+    }
+    node->children[node->child_count++] = child;
+    return 0;
+}
+
+// Снимок метаданных для --snapshot и --diff. Файл читается через mmap без
+// разбора: snapshot_header, затем записи каталогов в порядке обхода, все с
+// выравниванием 8 байт. Запись каталога - snapshot_dir, путь, записи
+// snapshot_entry по имени и пул их имён.
+//
+// При --diff каталог, у которого mtime и ctime совпали со снимком, не
+// перечитывается: состав записей у него прежний, подкаталоги берутся из
+// снимка, а файлы не статятся. Изменения файлов внутри такого каталога
+// (запись в файл, chmod) так не видны, как и у updatedb; --full-diff
+// перечитывает всё.
+#define SNAPSHOT_MAGIC "LSTS"
+#define SNAPSHOT_VERSION 1
+// Каталог, изменённый меньше чем за столько секунд до начала снимка, мог
+// измениться ещё раз с той же отметкой времени, поэтому перечитывается всегда.
+#define SNAPSHOT_RACY_SECONDS 2
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    int64_t start_time;
+} snapshot_header;
+
+typedef struct {
+    uint64_t record_length;
+    int64_t mtime;
+    int64_t ctime;
+    uint32_t mtime_nsec;
+    uint32_t ctime_nsec;
+    uint32_t path_length;
+    uint32_t entry_count;
+    uint64_t names_length;
+} snapshot_dir;
+
+typedef struct {
+    uint64_t ino;
+    int64_t size;
+    int64_t mtime;
+    int64_t ctime;
+    uint32_t mtime_nsec;
+    uint32_t ctime_nsec;
+    uint32_t mode;
+    uint32_t nlink;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t name;                  // смещение в пуле имён каталога
+    uint32_t reserved;
+} snapshot_entry;
+
+_Static_assert(sizeof(snapshot_dir) == 48 && sizeof(snapshot_entry) == 64,
+               "snapshot layout is part of the file format");
+
+typedef struct {
+    const char *data;
+    size_t size;
+    int64_t start_time;
+    const snapshot_dir **table;     // открытая адресация по пути
+    size_t capacity;
+} snapshot;
+
+const char *snapshot_path = NULL;   // куда сохранить снимок
+const char *diff_path = NULL;       // с каким снимком сравнивать
+int full_diff = 0;
+snapshot old_snapshot;
+FILE *snapshot_file;
+
+size_t align8(size_t length) {
+    return (length + 7) & ~(size_t)7;
+}
+
+const char *snapshot_dir_path(const snapshot_dir *dir) {
+    return (const char *)(dir + 1);
+}
+
+const snapshot_entry *snapshot_dir_entries(const snapshot_dir *dir) {
+    return (const snapshot_entry *)((const char *)(dir + 1) + align8(dir->path_length));
+}
+
+const char *snapshot_dir_names(const snapshot_dir *dir) {
+    return (const char *)(snapshot_dir_entries(dir) + dir->entry_count);
+}
+
+uint64_t hash_path(const char *path, size_t length) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char)path[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+const snapshot_dir *find_snapshot_dir(const char *path, size_t length) {
+    if (!old_snapshot.capacity) {
+        return NULL;
+    }
+    size_t slot = (size_t)hash_path(path, length) & (old_snapshot.capacity - 1);
+    while (old_snapshot.table[slot]) {
+        const snapshot_dir *dir = old_snapshot.table[slot];
+        if (dir->path_length == length && !memcmp(snapshot_dir_path(dir), path, length)) {
+            return dir;
+        }
+        slot = (slot + 1) & (old_snapshot.capacity - 1);
+    }
+    return NULL;
+}
+
+// Проверяет, что каждая запись каталога целиком лежит в файле и её имена
+// не выходят за пул: дальше снимок читается без проверок.
+int valid_snapshot_dir(const snapshot_dir *dir, size_t remaining) {
+    if (remaining < sizeof(snapshot_dir) || dir->record_length > remaining ||
+        dir->record_length % 8 != 0 || dir->names_length > remaining) {
+        return 0;
+    }
+    uint64_t length = sizeof(snapshot_dir) + align8(dir->path_length) +
+                      (uint64_t)dir->entry_count * sizeof(snapshot_entry) + align8(dir->names_length);
+    if (length != dir->record_length) {
+        return 0;
+    }
+    const char *names = snapshot_dir_names(dir);
+    if (dir->entry_count > 0 && (dir->names_length == 0 || names[dir->names_length - 1] != '\0')) {
+        return 0;
+    }
+    const snapshot_entry *entries = snapshot_dir_entries(dir);
+    for (uint32_t i = 0; i < dir->entry_count; i++) {
+        if (entries[i].name >= dir->names_length) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int load_snapshot(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Ошибка: не удалось открыть снимок %s\n", path);
+        return 1;
+    }
+    struct stat file_stats;
+    if (fstat(fd, &file_stats) != 0 || (size_t)file_stats.st_size < sizeof(snapshot_header)) {
+        fprintf(stderr, "Ошибка: %s - не снимок\n", path);
+        close(fd);
+        return 1;
+    }
+    size_t size = (size_t)file_stats.st_size;
+    const char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Ошибка: не удалось прочитать снимок %s\n", path);
+        return 1;
+    }
+    const snapshot_header *header = (const snapshot_header *)data;
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, 4) != 0 || header->version != SNAPSHOT_VERSION) {
+        fprintf(stderr, "Ошибка: %s - не снимок или другая версия\n", path);
+        munmap((void *)data, size);
+        return 1;
+    }
+
+    size_t count = 0;
+    for (size_t offset = sizeof(snapshot_header); offset < size;) {
+        const snapshot_dir *dir = (const snapshot_dir *)(data + offset);
+        if (!valid_snapshot_dir(dir, size - offset)) {
+            fprintf(stderr, "Ошибка: снимок %s повреждён\n", path);
+            munmap((void *)data, size);
+            return 1;
+        }
+        offset += dir->record_length;
+        count++;
+    }
+
+    size_t capacity = 64;
+    while (capacity < 2 * count) {
+        capacity *= 2;
+    }
+    old_snapshot.table = calloc(capacity, sizeof(snapshot_dir *));
+    if (!old_snapshot.table) {
+        fprintf(stderr, "Ошибка: не удалось выделить память\n");
+        munmap((void *)data, size);
+        return 1;
+    }
+    old_snapshot.data = data;
+    old_snapshot.size = size;
+    old_snapshot.start_time = header->start_time;
+    old_snapshot.capacity = capacity;
+    for (size_t offset = sizeof(snapshot_header); offset < size;) {
+        const snapshot_dir *dir = (const snapshot_dir *)(data + offset);
+        size_t slot = (size_t)hash_path(snapshot_dir_path(dir), dir->path_length) & (capacity - 1);
+        while (old_snapshot.table[slot]) {
+            slot = (slot + 1) & (capacity - 1);
+        }
+        old_snapshot.table[slot] = dir;
+        offset += dir->record_length;
+    }
+    return 0;
+}
+
+void free_snapshot() {
+    if (old_snapshot.data) {
+        munmap((void *)old_snapshot.data, old_snapshot.size);
+    }
+    free(old_snapshot.table);
+}
+
+int snapshot_dir_unchanged(const snapshot_dir *dir, const struct stat *dir_stats) {
+    return dir->mtime == (int64_t)dir_stats->st_mtim.tv_sec &&
+           dir->mtime_nsec == (uint32_t)dir_stats->st_mtim.tv_nsec &&
+           dir->ctime == (int64_t)dir_stats->st_ctim.tv_sec &&
+           dir->ctime_nsec == (uint32_t)dir_stats->st_ctim.tv_nsec &&
+           dir->ctime < old_snapshot.start_time - SNAPSHOT_RACY_SECONDS;
+}
+
+// Записи каталога в снимок, в порядке w->keys (по имени).
+int append_snapshot_dir(walker *w, out_buffer *snap, const char *path, size_t path_length,
+                        const struct stat *dir_stats, size_t count) {
+    size_t names_length = 0;
+    for (size_t i = 0; i < count; i++) {
+        names_length += strlen(w->names + w->entries[w->keys[i].index].name) + 1;
+    }
+    size_t length = sizeof(snapshot_dir) + align8(path_length) + count * sizeof(snapshot_entry) +
+                    align8(names_length);
+    if (names_length > UINT32_MAX || path_length > UINT32_MAX || out_reserve(snap, length) != 0) {
+        return 1;
+    }
+
+    char *start = snap->data + snap->length;
+    memset(start, 0, length);
+    snapshot_dir *dir = (snapshot_dir *)start;
+    dir->record_length = length;
+    dir->mtime = (int64_t)dir_stats->st_mtim.tv_sec;
+    dir->mtime_nsec = (uint32_t)dir_stats->st_mtim.tv_nsec;
+    dir->ctime = (int64_t)dir_stats->st_ctim.tv_sec;
+    dir->ctime_nsec = (uint32_t)dir_stats->st_ctim.tv_nsec;
+    dir->path_length = (uint32_t)path_length;
+    dir->entry_count = (uint32_t)count;
+    dir->names_length = names_length;
+    memcpy(start + sizeof(snapshot_dir), path, path_length);
+
+    snapshot_entry *entries = (snapshot_entry *)(start + sizeof(snapshot_dir) + align8(path_length));
+    char *names = (char *)(entries + count);
+    size_t name_offset = 0;
+    for (size_t i = 0; i < count; i++) {
+        const dir_entry *entry = &w->entries[w->keys[i].index];
+        const char *name = w->names + entry->name;
+        size_t name_size = strlen(name) + 1;
+        entries[i].ino = entry->ino;
+        entries[i].size = entry->size;
+        entries[i].mtime = entry->mtime;
+        entries[i].ctime = entry->ctime;
+        entries[i].mtime_nsec = entry->mtime_nsec;
+        entries[i].ctime_nsec = entry->ctime_nsec;
+        entries[i].mode = entry->mode;
+        entries[i].nlink = entry->nlink;
+        entries[i].uid = entry->uid;
+        entries[i].gid = entry->gid;
+        entries[i].name = (uint32_t)name_offset;
+        memcpy(names + name_offset, name, name_size);
+        name_offset += name_size;
+    }
+    snap->length += length;
+    return 0;
+}
+
+void entry_from_snapshot(const snapshot_entry *old, dir_entry *entry) {
+    memset(entry, 0, sizeof(*entry));
+    entry->ino = old->ino;
+    entry->size = old->size;
+    entry->mtime = old->mtime;
+    entry->ctime = old->ctime;
+    entry->mtime_nsec = old->mtime_nsec;
+    entry->ctime_nsec = old->ctime_nsec;
+    entry->mode = old->mode;
+    entry->nlink = old->nlink;
+    entry->uid = old->uid;
+    entry->gid = old->gid;
+    entry->first_block = -1;
+}
+
+// У каталогов mtime, размер и число ссылок меняются вместе с составом, а
+// состав сравнивается отдельно, поэтому для них важны только права,
+// владелец и inode.
+int entry_changed(const dir_entry *entry, const snapshot_entry *old) {
+    if (entry->mode != old->mode || entry->uid != old->uid || entry->gid != old->gid ||
+        entry->ino != old->ino) {
+        return 1;
+    }
+    if (S_ISDIR(entry->mode)) {
+        return 0;
+    }
+    return entry->size != old->size || entry->nlink != old->nlink ||
+           entry->mtime != old->mtime || entry->mtime_nsec != old->mtime_nsec ||
+           entry->ctime != old->ctime || entry->ctime_nsec != old->ctime_nsec;
+}
+
+char *join_path(const char *path, size_t path_length, const char *name, size_t *length) {
+    size_t name_length = strlen(name);
+    char *joined = malloc(path_length + name_length + 2);
+    if (joined) {
+        memcpy(joined, path, path_length);
+        joined[path_length] = '/';
+        memcpy(joined + path_length + 1, name, name_length + 1);
+        *length = path_length + 1 + name_length;
+    }
+    return joined;
+}
+
+// Удалённый каталог parent/name: всё, что было под ним в снимке, тоже
+// удалено.
+int report_removed_subtree(walker *w, out_buffer *out, const char *parent, size_t parent_length,
+                           const char *name) {
+    size_t path_length;
+    char *path = join_path(parent, parent_length, name, &path_length);
+    if (!path) {
+        return 1;
+    }
+    const snapshot_dir *old = find_snapshot_dir(path, path_length);
+    if (!old) {
+        free(path);
+        return 0;
+    }
+    const snapshot_entry *entries = snapshot_dir_entries(old);
+    const char *names = snapshot_dir_names(old);
+    const column_widths widths = {0, 0, 0, 0, 0, 0, 0};
+    for (uint32_t i = 0; i < old->entry_count; i++) {
+        dir_entry entry;
+        entry_from_snapshot(&entries[i], &entry);
+        const char *name = names + entries[i].name;
+        if (format_entry(w, out, path, path_length, name, &entry, &widths, CHANGE_REMOVED) != 0 ||
+            (recursive && S_ISDIR(entries[i].mode) &&
+             report_removed_subtree(w, out, path, path_length, name) != 0)) {
+            free(path);
+            return 1;
+        }
+    }
+    free(path);
+    return 0;
+}
+
+// Слияние записей по имени: новые (w->keys) и из снимка (old, может быть
+// NULL - тогда все записи новые).
+int diff_entries(walker *w, dir_node *node, const snapshot_dir *old, size_t count) {
+    const column_widths widths = {0, 0, 0, 0, 0, 0, 0};
+    size_t path_length = strlen(node->path);
+    const snapshot_entry *old_entries = old ? snapshot_dir_entries(old) : NULL;
+    const char *old_names = old ? snapshot_dir_names(old) : NULL;
+    size_t old_count = old ? old->entry_count : 0;
+    size_t i = 0;
+    size_t j = 0;
+    while (i < count || j < old_count) {
+        const dir_entry *entry = i < count ? &w->entries[w->keys[i].index] : NULL;
+        const char *name = entry ? w->names + entry->name : NULL;
+        const char *old_name = j < old_count ? old_names + old_entries[j].name : NULL;
+        int order = !entry ? 1 : !old_name ? -1 : strcmp(name, old_name);
+        int status = 0;
+        if (order < 0) {
+            status = format_entry(w, &node->out, node->path, path_length, name, entry, &widths, CHANGE_ADDED);
+            i++;
+        } else if (order > 0) {
+            dir_entry removed;
+            entry_from_snapshot(&old_entries[j], &removed);
+            status = format_entry(w, &node->out, node->path, path_length, old_name, &removed, &widths,
+                                  CHANGE_REMOVED);
+            if (status == 0 && recursive && S_ISDIR(old_entries[j].mode)) {
+                status = report_removed_subtree(w, &node->out, node->path, path_length, old_name);
+            }
+            j++;
+        } else {
+            if (entry_changed(entry, &old_entries[j])) {
+                status = format_entry(w, &node->out, node->path, path_length, name, entry, &widths,
+                                      CHANGE_CHANGED);
+                // Каталог заменён не каталогом: прежнее содержимое удалено.
+                if (status == 0 && recursive && S_ISDIR(old_entries[j].mode) && entry->type != DT_DIR) {
+                    status = report_removed_subtree(w, &node->out, node->path, path_length, name);
+                }
+            }
+            i++;
+            j++;
+        }
+        if (status != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Читает записи каталога и статит их в w->entries, ширины колонок - в
+// widths, порядок вывода - в w->keys. Возвращает число записей; ошибка
+// помечает каталог, но прочитанное до неё остаётся.
+size_t collect_entries(walker *w, dir_node *node, column_widths *widths) {
+    size_t count;
+    if (read_entries(w, node->fd, &count) != 0) {
+        fprintf(stderr, "Ошибка в explore_directory: не удалось прочитать каталог %s\n", node->path);
+        node->failed = 1;
+        count = 0;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        dir_entry *entry = &w->entries[i];
+        const char *name = w->names + entry->name;
+        if (process_file(w, node->fd, node->path, name, entry, widths) != 0) {
+            node->failed = 1;
+            count = i;
+            break;
+        }
+        // d_type есть почти везде; иначе lstat, чтобы не уйти по ссылке.
+        if (recursive && entry->type == DT_UNKNOWN) {
+            struct stat link_stats;
+            if (fstatat(node->fd, name, &link_stats, AT_SYMLINK_NOFOLLOW) == 0 &&
+                S_ISDIR(link_stats.st_mode)) {
+                entry->type = DT_DIR;
+            }
+        }
+    }
+    if (sort_entries(w, count) != 0) {
+        fprintf(stderr, "Ошибка в explore_directory: не удалось выделить память\n");
+        node->failed = 1;
+        count = 0;
+    }
+    return count;
+}
+
+// Если вывод уже ждёт этот каталог, готовое уходит сразу, и огромный
+// каталог не копится в памяти целиком.
+int stream_output(dir_node *node) {
+    if (node->out.length < STREAM_CHUNK || !atomic_load(&node->streaming)) {
+        return 0;
+    }
+    if (write_all(node->out.data, node->out.length) != 0) {
+        fprintf(stderr, "Ошибка: не удалось записать вывод\n");
+        atomic_store(&stop_walk, 1);
+        node->failed = 1;
+        return 1;
+    }
+    node->out.length = 0;
+    return 0;
+}
+
+// Обычный листинг: метаданные всех записей и ширины колонок, затем
+// сортировка и строки.
+void list_directory(walker *w, dir_node *node) {
+    if (output_format == FORMAT_TEXT &&
+        out_printf(&node->out, "Содержимое каталога: %s\n", node->path) != 0) {
+        fprintf(stderr, "Ошибка в explore_directory: не удалось выделить память\n");
+        node->failed = 1;
+        return;
+    }
+    column_widths widths = {0, 0, 0, 0, 0, 0, 0};
+    size_t count = collect_entries(w, node, &widths);
+
+    size_t folder_length = strlen(node->path);
+    size_t child_capacity = 0;
+    for (size_t i = 0; i < count; i++) {
+        const dir_entry *entry = &w->entries[w->keys[i].index];
+        if (!(entry->flags & ENTRY_HIDDEN) &&
+            format_entry(w, &node->out, node->path, folder_length, w->names + entry->name, entry,
+                         &widths, CHANGE_NONE) != 0) {
+            node->failed = 1;
+            break;
+        }
+        if (recursive && entry->type == DT_DIR &&
+            add_child(node, &child_capacity, w->names + entry->name) != 0) {
+            fprintf(stderr, "Ошибка в explore_directory: не удалось выделить память\n");
+            node->failed = 1;
+            break;
+        }
+        if (stream_output(node) != 0) {
+            break;
+        }
+    }
+}
+
+// --snapshot и --diff: запись каталога для нового снимка и отличия от
+// старого. Каталог, не менявшийся со старого снимка, не перечитывается.
+void scan_for_snapshot(walker *w, dir_node *node) {
+    struct stat dir_stats;
+    if (stat_entry(node->fd, "", AT_EMPTY_PATH, &dir_stats) != 0) {
+        fprintf(stderr, "Ошибка в explore_directory: не удалось получить информацию о каталоге %s\n",
+                node->path);
+        node->failed = 1;
+        return;
+    }
+    size_t path_length = strlen(node->path);
+    const snapshot_dir *old = diff_path ? find_snapshot_dir(node->path, path_length) : NULL;
+    size_t child_capacity = 0;
+
+    if (old && !full_diff && snapshot_dir_unchanged(old, &dir_stats)) {
+        if (snapshot_path && out_reserve(&node->snap, old->record_length) == 0) {
+            memcpy(node->snap.data, old, old->record_length);
+            node->snap.length = old->record_length;
+        }
+        const snapshot_entry *entries = snapshot_dir_entries(old);
+        const char *names = snapshot_dir_names(old);
+        for (uint32_t i = 0; recursive && i < old->entry_count; i++) {
+            if (S_ISDIR(entries[i].mode) && add_child(node, &child_capacity, names + entries[i].name) != 0) {
+                fprintf(stderr, "Ошибка в explore_directory: не удалось выделить память\n");
+                node->failed = 1;
+                return;
+            }
+        }
+        return;
+    }
+
+    column_widths widths = {0, 0, 0, 0, 0, 0, 0};
+    size_t count = collect_entries(w, node, &widths);
+    if (diff_path) {
+        if (diff_entries(w, node, old, count) != 0) {
+            fprintf(stderr, "Ошибка в explore_directory: не удалось выделить память\n");
+            node->failed = 1;
+        }
+    } else {
+        if (output_format == FORMAT_TEXT &&
+            out_printf(&node->out, "Содержимое каталога: %s\n", node->path) != 0) {
+            node->failed = 1;
+        }
+        for (size_t i = 0; i < count && !node->failed; i++) {
+            const dir_entry *entry = &w->entries[w->keys[i].index];
+            if ((!(entry->flags & ENTRY_HIDDEN) &&
+                 format_entry(w, &node->out, node->path, path_length, w->names + entry->name, entry,
+                              &widths, CHANGE_NONE) != 0) ||
+                stream_output(node) != 0) {
+                node->failed = 1;
+            }
+        }
+    }
+    for (size_t i = 0; i < count && recursive; i++) {
+        const dir_entry *entry = &w->entries[w->keys[i].index];
+        if (entry->type == DT_DIR && add_child(node, &child_capacity, w->names + entry->name) != 0) {
+            fprintf(stderr, "Ошибка в explore_directory: не удалось выделить память\n");
+            node->failed = 1;
+            return;
+        }
+    }
+    // Неполный каталог в снимок не попадает: в следующий раз он будет
+    // прочитан заново.
+    if (snapshot_path && !node->failed &&
+        append_snapshot_dir(w, &node->snap, node->path, path_length, &dir_stats, count) != 0) {
+        fprintf(stderr, "Ошибка в explore_directory: не удалось выделить память\n");
+        node->failed = 1;
+    }
+}
+
+// --du: вместо строк по файлам - занятое место каждого каталога вместе с
+// поддеревом, как у du, распределение размеров файлов по степеням двойки
+// и самые большие файлы. Обход тот же параллельный; каждый поток копит
+// гистограмму и свою кучу крупнейших файлов, а итоги по каталогам
+// складываются после обхода. Файл с несколькими жёсткими ссылками
+// считается один раз, и всегда в каталоге ссылки с наименьшим путём, а не
+// той, до которой первым дошёл какой-то поток: иначе итоги каталогов при
+// -j > 1 менялись бы от запуска к запуску. Такие файлы хранятся в общей
+// таблице по (dev, ino), разбитой на части со своими блокировками, и
+// засчитываются после обхода.
+#define LINK_SHARDS 64
+
+typedef struct {
+    uint64_t dev;
+    uint64_t ino;
+    dir_node *node;                 // каталог ссылки с наименьшим путём
+    char *path;                     // её путь, NULL - пусто
+    size_t dir_length;              // длина пути каталога в path
+    long long blocks;
+    long long size;
+    int regular;
+} link_owner;
+
+typedef struct {
+    alignas(64) pthread_mutex_t lock;
+    link_owner *owners;
+    size_t count;
+    size_t capacity;
+} link_shard;
+
+link_shard link_shards[LINK_SHARDS];
+
+uint64_t mix_link(uint64_t dev, uint64_t ino) {
+    uint64_t hash = (ino ^ (dev << 32 | dev >> 32)) * 0x9E3779B97F4A7C15ULL;
+    return hash ^ (hash >> 29);
+}
+
+int link_shard_grow(link_shard *shard) {
+    size_t capacity = shard->capacity ? shard->capacity * 2 : 256;
+    link_owner *owners = calloc(capacity, sizeof(link_owner));
+    if (!owners) {
+        return 1;
+    }
+    for (size_t i = 0; i < shard->capacity; i++) {
+        if (shard->owners[i].path) {
+            size_t slot = (size_t)mix_link(shard->owners[i].dev, shard->owners[i].ino) & (capacity - 1);
+            while (owners[slot].path) {
+                slot = (slot + 1) & (capacity - 1);
+            }
+            owners[slot] = shard->owners[i];
+        }
+    }
+    free(shard->owners);
+    shard->owners = owners;
+    shard->capacity = capacity;
+    return 0;
+}
+
+// Путь dir/name меньше path (как у strcmp), без сборки самого пути.
+int link_path_less(const char *dir, size_t dir_length, const char *name, const char *path) {
+    int order = strncmp(dir, path, dir_length);
+    if (order != 0) {
+        return order < 0;
+    }
+    if (path[dir_length] != '/') {
+        return (unsigned char)'/' < (unsigned char)path[dir_length];
+    }
+    return strcmp(name, path + dir_length + 1) < 0;
+}
+
+// Запоминает ссылку dir/name на файл, если её путь меньше уже известного.
+// 0 - успех, 1 - не хватило памяти.
+int claim_link(dir_node *node, size_t dir_length, const char *name, const struct stat *stats) {
+    uint64_t dev = (uint64_t)stats->st_dev;
+    uint64_t ino = (uint64_t)stats->st_ino;
+    uint64_t hash = mix_link(dev, ino);
+    link_shard *shard = &link_shards[hash >> 58];
+    int status = 0;
+    pthread_mutex_lock(&shard->lock);
+    if ((shard->count + 1) * 2 > shard->capacity && link_shard_grow(shard) != 0) {
+        status = 1;
+    } else {
+        size_t slot = (size_t)hash & (shard->capacity - 1);
+        while (shard->owners[slot].path && (shard->owners[slot].dev != dev || shard->owners[slot].ino != ino)) {
+            slot = (slot + 1) & (shard->capacity - 1);
+        }
+        link_owner *owner = &shard->owners[slot];
+        if (!owner->path || link_path_less(node->path, dir_length, name, owner->path)) {
+            size_t length;
+            char *path = join_path(node->path, dir_length, name, &length);
+            if (!path) {
+                status = 1;
+            } else {
+                if (!owner->path) {
+                    shard->count++;
+                }
+                free(owner->path);
+                owner->dev = dev;
+                owner->ino = ino;
+                owner->node = node;
+                owner->path = path;
+                owner->dir_length = dir_length;
+                owner->blocks = stats->st_blocks;
+                owner->size = stats->st_size;
+                owner->regular = S_ISREG(stats->st_mode);
+            }
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return status;
+}
+
+int size_bucket(long long size) {
+    int bucket = 0;
+    for (unsigned long long rest = (unsigned long long)size; rest; rest >>= 1) {
+        bucket++;
+    }
+    return bucket;
+}
+
+void sift_down_top(top_file *heap, size_t count, size_t root) {
+    while (2 * root + 1 < count) {
+        size_t child = 2 * root + 1;
+        if (child + 1 < count && heap[child + 1].size < heap[child].size) {
+            child++;
+        }
+        if (heap[root].size <= heap[child].size) {
+            break;
+        }
+        top_file swap = heap[root];
+        heap[root] = heap[child];
+        heap[child] = swap;
+        root = child;
+    }
+}
+
+// Куча по возрастанию: в вершине - меньший из top_limit крупнейших, и
+// путь собирается только для файла, который в неё попадает.
+int offer_top_file(walker *w, const char *path, size_t path_length, const char *name, long long size) {
+    if (top_limit == 0 || (w->top_count == top_limit && size <= w->top[0].size)) {
+        return 0;
+    }
+    size_t length;
+    char *joined = join_path(path, path_length, name, &length);
+    if (!joined) {
+        return 1;
+    }
+    if (w->top_count < top_limit) {
+        size_t child = w->top_count++;
+        while (child > 0 && w->top[(child - 1) / 2].size > size) {
+            w->top[child] = w->top[(child - 1) / 2];
+            child = (child - 1) / 2;
+        }
+        w->top[child].size = size;
+        w->top[child].path = joined;
+    } else {
+        free(w->top[0].path);
+        w->top[0].size = size;
+        w->top[0].path = joined;
+        sift_down_top(w->top, w->top_count, 0);
+    }
+    return 0;
+}
+
+// Считает файлы каталога и ставит подкаталоги в очередь. Место под сам
+// подкаталог родитель записывает сразу в его узел, корень статит себя сам.
+void du_directory(walker *w, dir_node *node) {
+    size_t count;
+    if (read_entries(w, node->fd, &count) != 0) {
+        fprintf(stderr, "Ошибка в explore_directory: не удалось прочитать каталог %s\n", node->path);
+        node->failed = 1;
+        count = 0;
+    }
+    struct stat stats;
+    if (!node->parent && stat_entry(node->fd, "", AT_EMPTY_PATH, &stats) == 0) {
+        node->du_blocks += stats.st_blocks;
+        node->du_size += stats.st_size;
+    }
+
+    size_t path_length = strlen(node->path);
+    size_t child_capacity = 0;
+    for (size_t i = 0; i < count; i++) {
+        const char *name = w->names + w->entries[i].name;
+        if (stat_entry(node->fd, name, AT_SYMLINK_NOFOLLOW, &stats) != 0) {
+            fprintf(stderr, "Ошибка в process_file: не удалось получить информацию о файле %s/%s\n",
+                    node->path, name);
+            node->failed = 1;
+            continue;
+        }
+        if (S_ISDIR(stats.st_mode)) {
+            if (add_child(node, &child_capacity, name) != 0) {
+                fprintf(stderr, "Ошибка в explore_directory: не удалось выделить память\n");
+                node->failed = 1;
+                return;
+            }
+            dir_node *child = node->children[node->child_count - 1];
+            child->du_blocks = stats.st_blocks;
+            child->du_size = stats.st_size;
+            continue;
+        }
+        if (stats.st_nlink > 1) {
+            if (claim_link(node, path_length, name, &stats) != 0) {
+                fprintf(stderr, "Ошибка в explore_directory: не удалось выделить память\n");
+                node->failed = 1;
+                return;
+            }
+            continue;
+        }
+        node->du_blocks += stats.st_blocks;
+        node->du_size += stats.st_size;
+        node->du_files++;
+        if (S_ISREG(stats.st_mode)) {
+            int bucket = size_bucket(stats.st_size);
+            w->size_counts[bucket]++;
+            w->size_bytes[bucket] += (uint64_t)stats.st_size;
+            if (offer_top_file(w, node->path, path_length, name, stats.st_size) != 0) {
+                fprintf(stderr, "Ошибка в explore_directory: не удалось выделить память\n");
+                node->failed = 1;
+                return;
+            }
+        }
+    }
+}
+
+// --watch: после первого листинга каталоги остаются под наблюдением, и
+// выводятся только изменившиеся записи (+ ~ -). При CAP_SYS_ADMIN события
+// идут из fanotify с FAN_REPORT_DFID_NAME: каталог приходит дескриптором
+// файла, имя - строкой, и нет предела max_user_watches. Иначе - inotify.
+// События копятся до паузы WATCH_QUIET_MS, но не дольше WATCH_BATCH_MS,
+// и каждая запись пачки статится один раз. Без событий процесс спит в poll.
+#define WATCH_QUIET_MS 100
+#define WATCH_BATCH_MS 1000
+#define WATCH_BUFFER_SIZE (64 * 1024)
+#define WATCH_KEY_SIZE (sizeof(__kernel_fsid_t) + sizeof(int) + MAX_HANDLE_SZ)
+#define INOTIFY_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY | IN_ATTRIB | \
+                      IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+#define FANOTIFY_MASK (FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO | FAN_MODIFY | FAN_ATTRIB | \
+                       FAN_DELETE_SELF | FAN_EVENT_ON_CHILD | FAN_ONDIR)
+
+// Биты событий у fanotify те же, что у inotify, и разбираются одинаково.
+_Static_assert(FAN_CREATE == IN_CREATE && FAN_DELETE == IN_DELETE && FAN_MOVED_FROM == IN_MOVED_FROM &&
+               FAN_MOVED_TO == IN_MOVED_TO && FAN_MODIFY == IN_MODIFY && FAN_ATTRIB == IN_ATTRIB,
+               "fanotify and inotify event bits differ");
+
+enum {
+    WATCH_APPEARED = 1,
+    WATCH_GONE = 2,
+    WATCH_MODIFIED = 4
+};
+
+typedef struct {
+    char *path;                     // NULL - каталог больше не наблюдается
+    size_t path_length;
+    int removed;                    // путь освободится после текущей пачки
+} watched_dir;
+
+typedef struct {
+    size_t dir;
+    char *name;
+    size_t sequence;
+    int flags;
+} watch_event;
+
+int watch_mode = 0;
+int watch_fd = -1;
+int watch_fanotify = 0;
+// inotify: индекс - номер наблюдения; fanotify: порядковый номер каталога,
+// а watch_table находит его по fsid и дескриптору файла.
+watched_dir *watched;
+size_t watched_count;
+size_t watched_capacity;
+size_t *watch_table;                // индекс + 1, 0 - пусто
+unsigned char **watch_keys;         // ключи по индексу каталога
+size_t watch_table_capacity;
+watch_event *watch_events;
+size_t watch_event_count;
+size_t watch_event_capacity;
+size_t *watch_removals;
+size_t watch_removal_count;
+size_t watch_removal_capacity;
+alignas(8) char watch_buffer[WATCH_BUFFER_SIZE];
+pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;   // таблицы наблюдений при обходе
+
+long long monotonic_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+int watched_reserve(size_t count) {
+    if (count <= watched_capacity) {
+        return 0;
+    }
+    size_t capacity = watched_capacity ? watched_capacity : 64;
+    while (capacity < count) {
+        capacity *= 2;
+    }
+    watched_dir *grown = realloc(watched, capacity * sizeof(watched_dir));
+    unsigned char **keys = realloc(watch_keys, capacity * sizeof(unsigned char *));
+    if (grown) {
+        watched = grown;
+    }
+    if (keys) {
+        watch_keys = keys;
+    }
+    if (!grown || !keys) {
+        return 1;
+    }
+    memset(watched + watched_capacity, 0, (capacity - watched_capacity) * sizeof(watched_dir));
+    memset(watch_keys + watched_capacity, 0, (capacity - watched_capacity) * sizeof(unsigned char *));
+    watched_capacity = capacity;
+    return 0;
+}
+
+// Ключ каталога для fanotify: fsid, тип дескриптора и его байты, с длиной
+// в первом байте.
+void make_watch_key(unsigned char *key, const void *fsid, const struct file_handle *handle) {
+    key[0] = (unsigned char)(sizeof(__kernel_fsid_t) + sizeof(int) + handle->handle_bytes);
+    memcpy(key + 1, fsid, sizeof(__kernel_fsid_t));
+    memcpy(key + 1 + sizeof(__kernel_fsid_t), &handle->handle_type, sizeof(int));
+    memcpy(key + 1 + sizeof(__kernel_fsid_t) + sizeof(int), handle->f_handle, handle->handle_bytes);
+}
+
+size_t *watch_slot(const unsigned char *key) {
+    size_t slot = (size_t)hash_path((const char *)key, key[0] + 1u) & (watch_table_capacity - 1);
+    while (watch_table[slot] && memcmp(watch_keys[watch_table[slot] - 1], key, key[0] + 1u) != 0) {
+        slot = (slot + 1) & (watch_table_capacity - 1);
+    }
+    return &watch_table[slot];
+}
+
+int watch_table_grow() {
+    size_t capacity = watch_table_capacity ? watch_table_capacity * 2 : 1024;
+    size_t *table = calloc(capacity, sizeof(size_t));
+    if (!table) {
+        return 1;
+    }
+    free(watch_table);
+    watch_table = table;
+    watch_table_capacity = capacity;
+    for (size_t i = 0; i < watched_count; i++) {
+        *watch_slot(watch_keys[i]) = i + 1;
+    }
+    return 0;
+}
+
+// Находит или заводит запись наблюдаемого каталога: по ключу для fanotify,
+// по номеру наблюдения для inotify. Вызывать под watch_lock.
+int watched_index(const unsigned char *key, int wd, size_t *index) {
+    if (!key) {
+        if (watched_reserve((size_t)wd + 1) != 0) {
+            return 1;
+        }
+        *index = (size_t)wd;
+        if (watched_count <= *index) {
+            watched_count = *index + 1;
+        }
+        return 0;
+    }
+    if ((watched_count + 1) * 2 > watch_table_capacity && watch_table_grow() != 0) {
+        return 1;
+    }
+    size_t *slot = watch_slot(key);
+    if (*slot) {
+        *index = *slot - 1;
+        return 0;
+    }
+    if (watched_reserve(watched_count + 1) != 0 || !(watch_keys[watched_count] = malloc(key[0] + 1u))) {
+        return 1;
+    }
+    memcpy(watch_keys[watched_count], key, key[0] + 1u);
+    *index = watched_count++;
+    *slot = *index + 1;
+    return 0;
+}
+
+// Ставит каталог под наблюдение. Каталог, уже исчезнувший, пропускается;
+// повторная постановка (каталог переехал) только обновляет путь. Вызывается
+// из потоков обхода, поэтому таблицы меняются под watch_lock.
+int watch_directory(const char *path) {
+    unsigned char key_buffer[1 + WATCH_KEY_SIZE];
+    const unsigned char *key = NULL;
+    int wd = -1;
+    if (watch_fanotify) {
+        alignas(struct file_handle) unsigned char handle_buffer[sizeof(struct file_handle) + MAX_HANDLE_SZ];
+        struct file_handle *handle = (struct file_handle *)handle_buffer;
+        struct statfs fs_stats;
+        int mount_id;
+        handle->handle_bytes = MAX_HANDLE_SZ;
+        if (fanotify_mark(watch_fd, FAN_MARK_ADD | FAN_MARK_ONLYDIR, FANOTIFY_MASK, AT_FDCWD, path) != 0 ||
+            name_to_handle_at(AT_FDCWD, path, handle, &mount_id, 0) != 0 || statfs(path, &fs_stats) != 0) {
+            if (errno != ENOENT && errno != ENOTDIR) {
+                fprintf(stderr, "Ошибка: не удалось наблюдать за каталогом %s\n", path);
+            }
+            return 0;
+        }
+        make_watch_key(key_buffer, &fs_stats.f_fsid, handle);
+        key = key_buffer;
+    } else {
+        wd = inotify_add_watch(watch_fd, path, INOTIFY_MASK);
+        if (wd < 0) {
+            if (errno == ENOSPC) {
+                fprintf(stderr, "Ошибка: исчерпан предел наблюдений inotify "
+                                "(/proc/sys/fs/inotify/max_user_watches), %s не наблюдается\n", path);
+            } else if (errno != ENOENT && errno != ENOTDIR) {
+                fprintf(stderr, "Ошибка: не удалось наблюдать за каталогом %s\n", path);
+            }
+            return 0;
+        }
+    }
+
+    char *copy = strdup(path);
+    if (!copy) {
+        return 1;
+    }
+    size_t index;
+    pthread_mutex_lock(&watch_lock);
+    int status = watched_index(key, wd, &index);
+    if (status == 0) {
+        free(watched[index].path);
+        watched[index].path = copy;
+        watched[index].path_length = strlen(path);
+        watched[index].removed = 0;
+    } else {
+        free(copy);
+    }
+    pthread_mutex_unlock(&watch_lock);
+    return status;
+}
+
+// Сканирует каталог в его буфер вывода и ставит подкаталоги в свой дек.
+// Ошибка прерывает только этот каталог, как раньше explore_directory.
+void scan_directory(walker *w, dir_node *node) {
+    if (atomic_load_explicit(&stop_walk, memory_order_relaxed)) {
+        if (node->parent) {
+            release_fd(node->parent);
+        }
+    } else if (open_node(node) != 0) {
+        fprintf(stderr, "Ошибка в explore_directory: не удалось получить доступ к каталогу %s\n", node->path);
+        node->failed = 1;
+    } else {
+        // Наблюдение ставится до чтения каталога: то, что изменится во время
+        // листинга, придёт событием, а не потеряется.
+        if (watch_mode && watch_directory(node->path) != 0) {
+            fprintf(stderr, "Ошибка в explore_directory: не удалось выделить память\n");
+            node->failed = 1;
+        }
+        if (du_mode) {
+            du_directory(w, node);
+        } else if (diff_path || snapshot_path) {
+            scan_for_snapshot(w, node);
+        } else {
+            list_directory(w, node);
+        }
+
+        // Подкаталоги кладутся в обратном порядке, чтобы первым снимался
+        // первый по выводу: тогда вывод не ждёт дальних веток.
+        atomic_store(&node->fd_users, (int)node->child_count + 1);
+        atomic_fetch_add(&dirs_pending, (long)node->child_count);
+        for (size_t i = node->child_count; i-- > 0;) {
+            if (deque_push(&node_deques[w->id], node->children[i]) != 0) {
+                fprintf(stderr, "Ошибка: дек каталогов переполнен\n");
+                exit(1);
+            }
+        }
+        release_fd(node);
+    }
+
+    pthread_mutex_lock(&emit_lock);
+    atomic_store(&node->done, 1);
+    pthread_cond_broadcast(&emit_cond);
+    pthread_mutex_unlock(&emit_lock);
+    atomic_fetch_sub(&dirs_pending, 1);
+}
+
+void *walk_worker(void *arg) {
+    walker *w = arg;
+    node_deque *own = &node_deques[w->id];
+    int idle = 0;
+
+    while (atomic_load(&dirs_pending) > 0) {
+        dir_node *node = deque_pop(own, 0);
+        if (!node && jobs > 1) {
+            // Соседей обходим по кругу: каждый простой пробует следующего,
+            // и никто не опрашивается дважды, пока не проверены все.
+            int victim = w->next_victim;
+            w->next_victim = (victim + 1) % jobs;
+            if (w->next_victim == w->id) {
+                w->next_victim = (w->next_victim + 1) % jobs;
+            }
+            node = deque_pop(&node_deques[victim], 1);
+            if (node) {
+                own->steals++;
+            }
+        }
+        if (!node) {
+            // Работа может появиться только у соседей: сначала уступаем
+            // процессор, при долгом простое засыпаем.
+            if (++idle < 64) {
+                sched_yield();
+            } else {
+                usleep(100);
+            }
+            continue;
+        }
+        idle = 0;
+        scan_directory(w, node);
+    }
+    return NULL;
+}
+
+// События об удалении содержимого каталога приходят раньше, чем о самом
+// каталоге, и ещё ждут в пачке: путь нужен им до её вывода.
+void unwatch_directory(size_t index) {
+    if (!watched[index].path || watched[index].removed) {
+        return;
+    }
+    if (watch_removal_count == watch_removal_capacity) {
+        size_t capacity = watch_removal_capacity ? watch_removal_capacity * 2 : 64;
+        size_t *grown = realloc(watch_removals, capacity * sizeof(size_t));
+        if (!grown) {
+            free(watched[index].path);
+            watched[index].path = NULL;
+            return;
+        }
+        watch_removals = grown;
+        watch_removal_capacity = capacity;
+    }
+    watched[index].removed = 1;
+    watch_removals[watch_removal_count++] = index;
+}
+
+void forget_removed_directories() {
+    for (size_t i = 0; i < watch_removal_count; i++) {
+        watched_dir *dir = &watched[watch_removals[i]];
+        if (dir->removed) {
+            free(dir->path);
+            dir->path = NULL;
+            dir->removed = 0;
+        }
+    }
+    watch_removal_count = 0;
+}
+
+int add_watch_event(size_t dir, const char *name, uint64_t mask) {
+    int flags = 0;
+    if (mask & (IN_CREATE | IN_MOVED_TO)) {
+        flags |= WATCH_APPEARED;
+    }
+    if (mask & (IN_DELETE | IN_MOVED_FROM)) {
+        flags |= WATCH_GONE;
+    }
+    if (mask & (IN_MODIFY | IN_ATTRIB)) {
+        flags |= WATCH_MODIFIED;
+    }
+    if (!flags || dir >= watched_count || !watched[dir].path || !strcmp(name, ".")) {
+        return 0;
+    }
+    if (watch_event_count == watch_event_capacity) {
+        size_t capacity = watch_event_capacity ? watch_event_capacity * 2 : 256;
+        watch_event *grown = realloc(watch_events, capacity * sizeof(watch_event));
+        if (!grown) {
+            return 1;
+        }
+        watch_events = grown;
+        watch_event_capacity = capacity;
+    }
+    watch_event *event = &watch_events[watch_event_count];
+    event->name = strdup(name);
+    if (!event->name) {
+        return 1;
+    }
+    event->dir = dir;
+    event->sequence = watch_event_count;
+    event->flags = flags;
+    watch_event_count++;
+    return 0;
+}
+
+int read_inotify_events() {
+    ssize_t length = read(watch_fd, watch_buffer, sizeof(watch_buffer));
+    if (length < 0) {
+        return errno == EINTR || errno == EAGAIN ? 0 : 1;
+    }
+    for (ssize_t offset = 0; offset < length;) {
+        const struct inotify_event *event = (const struct inotify_event *)(watch_buffer + offset);
+        offset += sizeof(struct inotify_event) + event->len;
+        if (event->mask & IN_Q_OVERFLOW) {
+            fprintf(stderr, "Ошибка: очередь событий переполнена, часть изменений пропущена\n");
+        } else if (event->mask & IN_IGNORED) {
+            if ((size_t)event->wd < watched_count) {
+                unwatch_directory((size_t)event->wd);
+            }
+        } else if (event->len > 0 && add_watch_event((size_t)event->wd, event->name, event->mask) != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Записи fanotify идут подряд без выравнивания, поэтому заголовки
+// копируются, а не читаются на месте.
+int read_fanotify_events() {
+    ssize_t length = read(watch_fd, watch_buffer, sizeof(watch_buffer));
+    if (length < 0) {
+        return errno == EINTR || errno == EAGAIN ? 0 : 1;
+    }
+    struct fanotify_event_metadata event;
+    for (ssize_t offset = 0; offset + (ssize_t)sizeof(event) <= length; offset += event.event_len) {
+        memcpy(&event, watch_buffer + offset, sizeof(event));
+        if (event.event_len < sizeof(event) || offset + (ssize_t)event.event_len > length) {
+            break;
+        }
+        if (event.mask & FAN_Q_OVERFLOW) {
+            fprintf(stderr, "Ошибка: очередь событий переполнена, часть изменений пропущена\n");
+            continue;
+        }
+        struct fanotify_event_info_fid info;
+        alignas(struct file_handle) unsigned char handle_buffer[sizeof(struct file_handle) + MAX_HANDLE_SZ];
+        struct file_handle *handle = (struct file_handle *)handle_buffer;
+        const char *record = watch_buffer + offset + event.metadata_len;
+        size_t record_length = event.event_len - event.metadata_len;
+        if (record_length < sizeof(info) + sizeof(struct file_handle)) {
+            continue;
+        }
+        memcpy(&info, record, sizeof(info));
+        memcpy(handle, record + sizeof(info), sizeof(struct file_handle));
+        if ((info.hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME &&
+             info.hdr.info_type != FAN_EVENT_INFO_TYPE_DFID) ||
+            handle->handle_bytes > MAX_HANDLE_SZ ||
+            sizeof(info) + sizeof(struct file_handle) + handle->handle_bytes > record_length ||
+            watch_table_capacity == 0) {
+            continue;
+        }
+        memcpy(handle->f_handle, record + sizeof(info) + sizeof(struct file_handle), handle->handle_bytes);
+        unsigned char key[1 + WATCH_KEY_SIZE];
+        make_watch_key(key, &info.fsid, handle);
+        size_t slot = *watch_slot(key);
+        if (!slot) {
+            continue;
+        }
+        const char *name = record + sizeof(info) + sizeof(struct file_handle) + handle->handle_bytes;
+        if (event.mask & FAN_DELETE_SELF) {
+            unwatch_directory(slot - 1);
+        } else if (info.hdr.info_type == FAN_EVENT_INFO_TYPE_DFID_NAME &&
+                   memchr(name, '\0', record_length - (size_t)(name - record)) &&
+                   add_watch_event(slot - 1, name, event.mask) != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int compare_watch_events(const void *a, const void *b) {
+    const watch_event *left = a;
+    const watch_event *right = b;
+    if (left->dir != right->dir) {
+        return left->dir < right->dir ? -1 : 1;
+    }
+    int order = strcmp(left->name, right->name);
+    if (order != 0) {
+        return order;
+    }
+    return left->sequence < right->sequence ? -1 : left->sequence > right->sequence;
+}
+
+int format_watch_entry(walker *w, out_buffer *out, int dir_fd, const char *path, size_t path_length,
+                       const char *name, const struct stat *stats, enum entry_change change) {
+    dir_entry entry;
+    column_widths widths = {0, 0, 0, 0, 0, 0, 0};
+    fill_entry(w, dir_fd, name, stats, &entry, &widths);
+    if (entry.flags & ENTRY_HIDDEN) {
+        return 0;
+    }
+    return format_entry(w, out, path, path_length, name, &entry, &widths, change);
+}
+
+// Исчезнувшая запись: прежних метаданных нет, выводится только путь.
+int format_gone_entry(out_buffer *out, const char *path, size_t path_length, const char *name) {
+    size_t name_length = strlen(name);
+    if (out_reserve(out, 64 + 6 * (path_length + 1 + name_length)) != 0) {
+        fprintf(stderr, "Ошибка: не удалось выделить память\n");
+        return 1;
+    }
+    char *p = out->data + out->length;
+    if (output_format == FORMAT_JSONL) {
+        p = put_text(p, "{\"change\":\"removed\",\"path\":\"", 28);
+        p = put_json_chars(p, path, path_length);
+        *p++ = '/';
+        p = put_json_chars(p, name, name_length);
+        p = put_text(p, "\"}\n", 3);
+    } else {
+        p = put_text(p, "- ", 2);
+        p = put_text(p, path, path_length);
+        *p++ = '/';
+        p = put_text(p, name, name_length);
+        *p++ = '\n';
+    }
+    out->length = (size_t)(p - out->data);
+    return 0;
+}
+
+// Новый при -R каталог ставится под наблюдение до чтения, чтобы не
+// потерять создаваемое в нём, и всё его содержимое выводится как новое.
+int watch_new_tree(walker *w, out_buffer *out, const char *parent, size_t parent_length, const char *name) {
+    size_t path_length;
+    char *path = join_path(parent, parent_length, name, &path_length);
+    if (!path || watch_directory(path) != 0) {
+        free(path);
+        return 1;
+    }
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        free(path);
+        return 0;
+    }
+    size_t count;
+    if (read_entries(w, fd, &count) != 0) {
+        count = 0;
+    }
+
+    // Имена подкаталогов копируются: рекурсия перезапишет w->names.
+    char **subdirs = NULL;
+    size_t subdir_count = 0;
+    int status = 0;
+    for (size_t i = 0; i < count && status == 0; i++) {
+        const char *entry_name = w->names + w->entries[i].name;
+        struct stat stats;
+        if (stat_entry(fd, entry_name, 0, &stats) != 0 &&
+            fstatat(fd, entry_name, &stats, AT_SYMLINK_NOFOLLOW) != 0) {
+            continue;
+        }
+        int is_dir = w->entries[i].type == DT_DIR;
+        status = format_watch_entry(w, out, fd, path, path_length, entry_name, &stats, CHANGE_ADDED);
+        if (status == 0 && is_dir) {
+            char **grown = realloc(subdirs, (subdir_count + 1) * sizeof(char *));
+            if (!grown || !(grown[subdir_count] = strdup(entry_name))) {
+                subdirs = grown ? grown : subdirs;
+                status = 1;
+            } else {
+                subdirs = grown;
+                subdir_count++;
+            }
+        }
+    }
+    close(fd);
+    for (size_t i = 0; i < subdir_count; i++) {
+        if (status == 0) {
+            status = watch_new_tree(w, out, path, path_length, subdirs[i]);
+        }
+        free(subdirs[i]);
+    }
+    free(subdirs);
+    free(path);
+    return status;
+}
+
+// Сводит события пачки по записи и выводит итог: запись есть - новая или
+// изменённая, нет - удалённая. Появившееся и исчезнувшее внутри одной
+// пачки (временные файлы) не выводится вовсе.
+int flush_watch_events(walker *w) {
+    qsort(watch_events, watch_event_count, sizeof(watch_event), compare_watch_events);
+    out_buffer out = {NULL, 0, 0};
+    int status = 0;
+    int dir_fd = -1;
+    size_t open_dir = SIZE_MAX;
+    for (size_t i = 0; i < watch_event_count;) {
+        const watch_event *event = &watch_events[i];
+        int flags = 0;
+        size_t next = i;
+        for (; next < watch_event_count && watch_events[next].dir == event->dir &&
+               !strcmp(watch_events[next].name, event->name);
+             next++) {
+            flags |= watch_events[next].flags;
+        }
+
+        const watched_dir *dir = &watched[event->dir];
+        if (dir->path && status == 0) {
+            if (event->dir != open_dir) {
+                if (dir_fd >= 0) {
+                    close(dir_fd);
+                }
+                dir_fd = open(dir->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                open_dir = event->dir;
+            }
+            struct stat link_stats;
+            struct stat stats;
+            if (dir_fd >= 0 && fstatat(dir_fd, event->name, &link_stats, AT_SYMLINK_NOFOLLOW) == 0) {
+                if (stat_entry(dir_fd, event->name, 0, &stats) != 0) {
+                    stats = link_stats;
+                }
+                enum entry_change change = (flags & WATCH_APPEARED) ? CHANGE_ADDED : CHANGE_CHANGED;
+                status = format_watch_entry(w, &out, dir_fd, dir->path, dir->path_length, event->name,
+                                            &stats, change);
+                if (status == 0 && recursive && change == CHANGE_ADDED && S_ISDIR(link_stats.st_mode)) {
+                    status = watch_new_tree(w, &out, dir->path, dir->path_length, event->name);
+                }
+            } else if (!(event->flags & WATCH_APPEARED)) {
+                status = format_gone_entry(&out, dir->path, dir->path_length, event->name);
+            }
+        }
+        for (; i < next; i++) {
+            free(watch_events[i].name);
+        }
+    }
+    if (dir_fd >= 0) {
+        close(dir_fd);
+    }
+    watch_event_count = 0;
+    forget_removed_directories();
+    if (status != 0) {
+        fprintf(stderr, "Ошибка: не удалось выделить память\n");
+    } else if ((out.length > 0 && emit_bytes(out.data, out.length) != 0) || flush_output() != 0) {
+        fprintf(stderr, "Ошибка: не удалось записать вывод\n");
+        status = 1;
+    }
+    free(out.data);
+    return status;
+}
+
+int start_watch() {
+#ifdef FAN_REPORT_DFID_NAME
+    watch_fd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME | FAN_CLOEXEC | FAN_NONBLOCK,
+                             O_RDONLY | O_LARGEFILE);
+    if (watch_fd >= 0) {
+        watch_fanotify = 1;
+        return 0;
+    }
+#endif
+    watch_fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (watch_fd < 0) {
+        fprintf(stderr, "Ошибка: не удалось начать наблюдение\n");
+        return 1;
+    }
+    return 0;
+}
+
+// Возвращается только при ошибке.
+int run_watch(walker *w) {
+    struct pollfd poll_fd = {watch_fd, POLLIN, 0};
+    long long batch_start = 0;
+    long long last_event = 0;
+    for (;;) {
+        int timeout = -1;
+        if (watch_event_count > 0) {
+            long long deadline = last_event + WATCH_QUIET_MS;
+            if (deadline > batch_start + WATCH_BATCH_MS) {
+                deadline = batch_start + WATCH_BATCH_MS;
+            }
+            long long wait = deadline - monotonic_ms();
+            timeout = wait > 0 ? (int)wait : 0;
+        }
+        if (timeout != 0) {
+            int ready = poll(&poll_fd, 1, timeout);
+            if (ready < 0 && errno != EINTR) {
+                fprintf(stderr, "Ошибка: не удалось дождаться событий\n");
+                return 1;
+            }
+            if (ready > 0) {
+                size_t before = watch_event_count;
+                if ((watch_fanotify ? read_fanotify_events() : read_inotify_events()) != 0) {
+                    fprintf(stderr, "Ошибка: не удалось прочитать события\n");
+                    return 1;
+                }
+                if (watch_event_count > before) {
+                    last_event = monotonic_ms();
+                    if (before == 0) {
+                        batch_start = last_event;
+                    }
+                }
+                continue;
+            }
+        }
+        if (watch_event_count > 0 && flush_watch_events(w) != 0) {
+            return 1;
+        }
+    }
+}
+
+void free_watch() {
+    if (watch_fd >= 0) {
+        close(watch_fd);
+    }
+    for (size_t i = 0; i < watched_count; i++) {
+        free(watched[i].path);
+        if (watch_fanotify) {
+            free(watch_keys[i]);
+        }
+    }
+    free(watched);
+    free(watch_keys);
+    free(watch_table);
+    free(watch_events);
+    free(watch_removals);
+}
+
+// Печатает дерево в прямом порядке, дожидаясь каждого каталога: это и есть
+// буфер переупорядочивания. Выведенный каталог освобождается, как только
+// выведены все его подкаталоги.
+typedef struct {
+    dir_node *node;
+    size_t next;
+} emit_frame;
+
+// Если каталог ещё не готов, вывод до него сбрасывается и каталог
+// помечается как текущий: дальше его поток обхода пишет готовые куски сам.
+int emit_node(dir_node *node, int *first) {
+    int stopped = atomic_load(&stop_walk);
+    if (!stopped && !*first && output_format == FORMAT_TEXT && !diff_path && emit_bytes("\n", 1) != 0) {
+        stopped = 1;
+    }
+    *first = 0;
+    pthread_mutex_lock(&emit_lock);
+    if (!stopped && !atomic_load(&node->done)) {
+        if (flush_output() != 0) {
+            stopped = 1;
+        } else {
+            atomic_store(&node->streaming, 1);
+        }
+    }
+    if (stopped && !atomic_load(&stop_walk)) {
+        fprintf(stderr, "Ошибка: не удалось записать вывод\n");
+        atomic_store(&stop_walk, 1);
+    }
+    while (!atomic_load(&node->done)) {
+        pthread_cond_wait(&emit_cond, &emit_lock);
+    }
+    pthread_mutex_unlock(&emit_lock);
+
+    if (atomic_load(&stop_walk)) {
+        return stopped || node->failed;
+    }
+    if (node->out.length > 0 && emit_bytes(node->out.data, node->out.length) != 0) {
+        fprintf(stderr, "Ошибка: не удалось записать вывод\n");
+        atomic_store(&stop_walk, 1);
+        return 1;
+    }
+    free(node->out.data);
+    node->out.data = NULL;
+    // Записи снимка идут в том же прямом порядке, что и вывод.
+    if (snapshot_file && node->snap.length > 0 &&
+        fwrite(node->snap.data, node->snap.length, 1, snapshot_file) != 1) {
+        fprintf(stderr, "Ошибка: не удалось записать снимок %s\n", snapshot_path);
+        atomic_store(&stop_walk, 1);
+        return 1;
+    }
+    if (node->failed) {
+        // Без -R первая ошибка, как и раньше, завершает вывод.
+        if (!recursive) {
+            atomic_store(&stop_walk, 1);
+        }
+        return 1;
+    }
+    return 0;
+}
+
+int emit_tree(dir_node **roots, int root_count) {
+    emit_frame *stack = NULL;
+    size_t depth = 0;
+    size_t capacity = 0;
+    int status = 0;
+    int first = 1;
+
+    for (int r = 0; r < root_count; r++) {
+        dir_node *node = roots[r];
+        while (node || depth > 0) {
+            if (node) {
+                status |= emit_node(node, &first);
+                if (depth == capacity) {
+                    capacity = capacity ? capacity * 2 : 64;
+                    emit_frame *grown = realloc(stack, capacity * sizeof(emit_frame));
+                    if (!grown) {
+                        fprintf(stderr, "Ошибка: не удалось выделить память\n");
+                        exit(1);
+                    }
+                    stack = grown;
+                }
+                stack[depth].node = node;
+                stack[depth].next = 0;
+                depth++;
+                node = NULL;
+            }
+            emit_frame *top = &stack[depth - 1];
+            if (top->next < top->node->child_count) {
+                node = top->node->children[top->next++];
+            } else {
+                free_node(top->node);
+                depth--;
+            }
+        }
+    }
+    free(stack);
+    if (flush_output() != 0) {
+        fprintf(stderr, "Ошибка: не удалось записать вывод\n");
+        status = 1;
+    }
+    return status;
+}
+
+// Строка итога каталога: как у du, килобайты занятого места, затем
+// байты по размерам файлов и путь.
+int format_du_line(out_buffer *out, const dir_node *node) {
+    size_t path_length = strlen(node->path);
+    if (out_reserve(out, 128 + 6 * path_length) != 0) {
+        return 1;
+    }
+    char *p = out->data + out->length;
+    if (output_format == FORMAT_JSONL) {
+        p = put_text(p, "{\"type\":\"dir\",\"disk\":", 21);
+        p = put_number(p, node->du_blocks * 512, 1, 0);
+        p = put_text(p, ",\"size\":", 8);
+        p = put_number(p, node->du_size, 1, 0);
+        p = put_text(p, ",\"files\":", 9);
+        p = put_number(p, node->du_files, 1, 0);
+        p = put_text(p, ",\"path\":\"", 9);
+        p = put_json_chars(p, node->path, path_length);
+        p = put_text(p, "\"}\n", 3);
+    } else {
+        p = put_number(p, (node->du_blocks + 1) / 2, 1, 0);
+        *p++ = '\t';
+        p = put_number(p, node->du_size, 1, 0);
+        *p++ = '\t';
+        p = put_text(p, node->path, path_length);
+        *p++ = '\n';
+    }
+    out->length = (size_t)(p - out->data);
+    return 0;
+}
+
+int compare_top_files(const void *a, const void *b) {
+    const top_file *left = a;
+    const top_file *right = b;
+    if (left->size != right->size) {
+        return left->size > right->size ? -1 : 1;
+    }
+    return strcmp(left->path, right->path);
+}
+
+// Гистограмма по всем потокам и общий список крупнейших файлов.
+int format_du_summary(out_buffer *out) {
+    uint64_t counts[SIZE_BUCKETS] = {0};
+    uint64_t bytes[SIZE_BUCKETS] = {0};
+    size_t top_total = 0;
+    for (int i = 0; i < jobs; i++) {
+        for (int bucket = 0; bucket < SIZE_BUCKETS; bucket++) {
+            counts[bucket] += walkers[i].size_counts[bucket];
+            bytes[bucket] += walkers[i].size_bytes[bucket];
+        }
+        top_total += walkers[i].top_count;
+    }
+    int status = 0;
+    if (output_format == FORMAT_TEXT) {
+        status |= out_printf(out, "\nРазмеры файлов: от, до, файлов, байт\n");
+    }
+    for (int bucket = 0; bucket < SIZE_BUCKETS; bucket++) {
+        if (!counts[bucket]) {
+            continue;
+        }
+        unsigned long long low = bucket ? 1ULL << (bucket - 1) : 0;
+        unsigned long long high = bucket == 0 ? 0 : bucket == 64 ? ULLONG_MAX : (1ULL << bucket) - 1;
+        status |= out_printf(out, output_format == FORMAT_JSONL
+                                      ? "{\"type\":\"histogram\",\"min\":%llu,\"max\":%llu,\"files\":%llu,\"size\":%llu}\n"
+                                      : "%llu\t%llu\t%llu\t%llu\n",
+                             low, high, (unsigned long long)counts[bucket], (unsigned long long)bytes[bucket]);
+    }
+
+    top_file *top = malloc((top_total ? top_total : 1) * sizeof(top_file));
+    if (!top) {
+        return 1;
+    }
+    size_t count = 0;
+    for (int i = 0; i < jobs; i++) {
+        memcpy(top + count, walkers[i].top, walkers[i].top_count * sizeof(top_file));
+        count += walkers[i].top_count;
+    }
+    qsort(top, count, sizeof(top_file), compare_top_files);
+    if (count > top_limit) {
+        count = top_limit;
+    }
+    if (output_format == FORMAT_TEXT && count > 0) {
+        status |= out_printf(out, "\nКрупнейшие файлы:\n");
+    }
+    for (size_t i = 0; i < count && status == 0; i++) {
+        size_t path_length = strlen(top[i].path);
+        status |= out_reserve(out, 64 + 6 * path_length);
+        if (status != 0) {
+            break;
+        }
+        char *p = out->data + out->length;
+        if (output_format == FORMAT_JSONL) {
+            p = put_text(p, "{\"type\":\"largest\",\"size\":", 25);
+            p = put_number(p, top[i].size, 1, 0);
+            p = put_text(p, ",\"path\":\"", 9);
+            p = put_json_chars(p, top[i].path, path_length);
+            p = put_text(p, "\"}\n", 3);
+        } else {
+            p = put_number(p, top[i].size, 1, 0);
+            *p++ = '\t';
+            p = put_text(p, top[i].path, path_length);
+            *p++ = '\n';
+        }
+        out->length = (size_t)(p - out->data);
+    }
+    free(top);
+    return status;
+}
+
+// Засчитывает файлы с жёсткими ссылками каталогам, выбранным при обходе.
+// Гистограмма и куча крупнейших - нулевого потока: они всё равно
+// сводятся по всем потокам.
+int settle_links() {
+    walker *w = &walkers[0];
+    for (int i = 0; i < LINK_SHARDS; i++) {
+        link_shard *shard = &link_shards[i];
+        for (size_t slot = 0; slot < shard->capacity; slot++) {
+            link_owner *owner = &shard->owners[slot];
+            if (!owner->path) {
+                continue;
+            }
+            owner->node->du_blocks += owner->blocks;
+            owner->node->du_size += owner->size;
+            owner->node->du_files++;
+            if (owner->regular) {
+                int bucket = size_bucket(owner->size);
+                w->size_counts[bucket]++;
+                w->size_bytes[bucket] += (uint64_t)owner->size;
+                if (offer_top_file(w, owner->path, owner->dir_length, owner->path + owner->dir_length + 1,
+                                   owner->size) != 0) {
+                    return 1;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+// После обхода: итоги поддеревьев складываются в обратном порядке обхода
+// и выводятся, как у du, подкаталоги раньше каталога.
+int report_disk_usage(dir_node **roots, int root_count) {
+    emit_frame *stack = NULL;
+    size_t depth = 0;
+    size_t capacity = 0;
+    int status = 0;
+    out_buffer out = {NULL, 0, 0};
+
+    if (settle_links() != 0) {
+        fprintf(stderr, "Ошибка: не удалось выделить память\n");
+        exit(1);
+    }
+    for (int r = 0; r < root_count; r++) {
+        dir_node *node = roots[r];
+        while (node || depth > 0) {
+            if (node) {
+                status |= node->failed;
+                if (depth == capacity) {
+                    capacity = capacity ? capacity * 2 : 64;
+                    emit_frame *grown = realloc(stack, capacity * sizeof(emit_frame));
+                    if (!grown) {
+                        fprintf(stderr, "Ошибка: не удалось выделить память\n");
+                        exit(1);
+                    }
+                    stack = grown;
+                }
+                stack[depth].node = node;
+                stack[depth].next = 0;
+                depth++;
+                node = NULL;
+            }
+            emit_frame *top = &stack[depth - 1];
+            if (top->next < top->node->child_count) {
+                node = top->node->children[top->next++];
+                continue;
+            }
+            dir_node *done = top->node;
+            depth--;
+            if (done->parent) {
+                done->parent->du_blocks += done->du_blocks;
+                done->parent->du_size += done->du_size;
+                done->parent->du_files += done->du_files;
+            }
+            if (format_du_line(&out, done) != 0) {
+                fprintf(stderr, "Ошибка: не удалось выделить память\n");
+                exit(1);
+            }
+            free_node(done);
+            if (out.length >= STREAM_CHUNK) {
+                if (emit_bytes(out.data, out.length) != 0) {
+                    fprintf(stderr, "Ошибка: не удалось записать вывод\n");
+                    free(out.data);
+                    free(stack);
+                    return 1;
+                }
+                out.length = 0;
+            }
+        }
+    }
+    free(stack);
+    if (format_du_summary(&out) != 0) {
+        fprintf(stderr, "Ошибка: не удалось выделить память\n");
+        status = 1;
+    }
+    if ((out.length > 0 && emit_bytes(out.data, out.length) != 0) || flush_output() != 0) {
+        fprintf(stderr, "Ошибка: не удалось записать вывод\n");
+        status = 1;
+    }
+    free(out.data);
+    return status;
+}
+
+void print_usage(const char *program) {
+    fprintf(stderr, "Использование: %s [параметры] <каталог1> [каталог2 ...]\n", program);
+    fprintf(stderr, "  -R, --recursive  обойти всё дерево\n");
+    fprintf(stderr, "  -j, --jobs=N     число потоков обхода (по умолчанию - число CPU)\n");
+    fprintf(stderr, "  --sort=ПОРЯДОК   name (по умолчанию), size, time или none\n");
+    fprintf(stderr, "  --format=ВИД     text (по умолчанию), jsonl или binary\n");
+    fprintf(stderr, "  --no-blocks      не читать экстенты, без открытия каждого файла\n");
+    fprintf(stderr, "  --extents        после блока - число экстентов и разрывов между ними\n");
+    fprintf(stderr, "  --min-frag=N     только обычные файлы, у которых не меньше N разрывов\n");
+    fprintf(stderr, "  --snapshot=ФАЙЛ  сохранить метаданные обхода в снимок\n");
+    fprintf(stderr, "  --diff=ФАЙЛ      вывести только отличия от снимка (+ ~ -)\n");
+    fprintf(stderr, "  --full-diff      при --diff перечитывать и неизменённые каталоги\n");
+    fprintf(stderr, "  --watch          после листинга выводить изменения по мере их появления\n");
+    fprintf(stderr, "  --du             занятое место по каталогам, гистограмма размеров, крупнейшие файлы\n");
+    fprintf(stderr, "  --top=N          сколько крупнейших файлов выводить при --du (по умолчанию 10)\n");
+}
+
+enum {
+    OPTION_NO_BLOCKS = 256,
+    OPTION_EXTENTS,
+    OPTION_MIN_FRAG,
+    OPTION_SORT,
+    OPTION_FORMAT,
+    OPTION_SNAPSHOT,
+    OPTION_DIFF,
+    OPTION_FULL_DIFF,
+    OPTION_WATCH,
+    OPTION_DU,
+    OPTION_TOP
+};
+
+int main(int argc, char *argv[]) {
+    static const struct option long_options[] = {
+        {"recursive", no_argument, NULL, 'R'},
+        {"jobs", required_argument, NULL, 'j'},
+        {"no-blocks", no_argument, NULL, OPTION_NO_BLOCKS},
+        {"extents", no_argument, NULL, OPTION_EXTENTS},
+        {"min-frag", required_argument, NULL, OPTION_MIN_FRAG},
+        {"sort", required_argument, NULL, OPTION_SORT},
+        {"format", required_argument, NULL, OPTION_FORMAT},
+        {"snapshot", required_argument, NULL, OPTION_SNAPSHOT},
+        {"diff", required_argument, NULL, OPTION_DIFF},
+        {"full-diff", no_argument, NULL, OPTION_FULL_DIFF},
+        {"watch", no_argument, NULL, OPTION_WATCH},
+        {"du", no_argument, NULL, OPTION_DU},
+        {"top", required_argument, NULL, OPTION_TOP},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    int option;
+    while ((option = getopt_long(argc, argv, "Rj:h", long_options, NULL)) != -1) {
+        switch (option) {
+            case 'R':
+                recursive = 1;
+                break;
+            case 'j': {
+                char *end;
+                long value = strtol(optarg, &end, 10);
+                if (*end != '\0' || value < 1 || value > 1024) {
+                    fprintf(stderr, "Ошибка: неверное число потоков: %s\n", optarg);
+                    return 1;
+                }
+                jobs = (int)value;
+                break;
+            }
+            case OPTION_NO_BLOCKS:
+                show_blocks = 0;
+                break;
+            case OPTION_EXTENTS:
+                show_extents = 1;
+                break;
+            case OPTION_MIN_FRAG: {
+                char *end;
+                long value = strtol(optarg, &end, 10);
+                if (*end != '\0' || value < 1 || value > 1000000) {
+                    fprintf(stderr, "Ошибка: неверное число разрывов: %s\n", optarg);
+                    return 1;
+                }
+                min_fragments = (unsigned int)value;
+                break;
+            }
+            case OPTION_SORT:
+                if (!strcmp(optarg, "name")) {
+                    sort_by = SORT_NAME;
+                } else if (!strcmp(optarg, "size")) {
+                    sort_by = SORT_SIZE;
+                } else if (!strcmp(optarg, "time")) {
+                    sort_by = SORT_TIME;
+                } else if (!strcmp(optarg, "none")) {
+                    sort_by = SORT_NONE;
+                } else {
+                    fprintf(stderr, "Ошибка: неизвестный порядок сортировки: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case OPTION_FORMAT:
+                if (!strcmp(optarg, "text")) {
+                    output_format = FORMAT_TEXT;
+                } else if (!strcmp(optarg, "jsonl")) {
+                    output_format = FORMAT_JSONL;
+                } else if (!strcmp(optarg, "binary")) {
+                    output_format = FORMAT_BINARY;
+                } else {
+                    fprintf(stderr, "Ошибка: неизвестный формат вывода: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case OPTION_SNAPSHOT:
+                snapshot_path = optarg;
+                break;
+            case OPTION_DIFF:
+                diff_path = optarg;
+                break;
+            case OPTION_FULL_DIFF:
+                full_diff = 1;
+                break;
+            case OPTION_WATCH:
+                watch_mode = 1;
+                break;
+            case OPTION_DU:
+                du_mode = 1;
+                recursive = 1;
+                break;
+            case OPTION_TOP: {
+                char *end;
+                long value = strtol(optarg, &end, 10);
+                if (*end != '\0' || value < 0 || value > 1000000) {
+                    fprintf(stderr, "Ошибка: неверное число файлов: %s\n", optarg);
+                    return 1;
+                }
+                top_limit = (size_t)value;
+                break;
+            }
+            default:
+                print_usage(argv[0]);
+                return option == 'h' ? 0 : 1;
+        }
+    }
+    if (!show_blocks && (show_extents || min_fragments > 0)) {
+        fprintf(stderr, "Ошибка: --no-blocks несовместим с --extents и --min-frag\n");
+        return 1;
+    }
+    // Снимок и сравнение с ним держатся на порядке записей по имени.
+    if ((snapshot_path || diff_path) && sort_by != SORT_NAME) {
+        fprintf(stderr, "Ошибка: --snapshot и --diff работают только с --sort=name\n");
+        return 1;
+    }
+    if (diff_path && (output_format == FORMAT_BINARY || min_fragments > 0)) {
+        fprintf(stderr, "Ошибка: --diff несовместим с --format=binary и --min-frag\n");
+        return 1;
+    }
+    if (watch_mode && (snapshot_path || diff_path || output_format == FORMAT_BINARY)) {
+        fprintf(stderr, "Ошибка: --watch несовместим с --snapshot, --diff и --format=binary\n");
+        return 1;
+    }
+    if (du_mode && (snapshot_path || diff_path || watch_mode || output_format == FORMAT_BINARY)) {
+        fprintf(stderr, "Ошибка: --du несовместим с --snapshot, --diff, --watch и --format=binary\n");
+        return 1;
+    }
+    if (full_diff && !diff_path) {
+        fprintf(stderr, "Ошибка: --full-diff имеет смысл только с --diff\n");
+        return 1;
+    }
+    int root_count = argc - optind;
+    if (root_count < 1) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    if (jobs == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        jobs = cpus > 0 ? (int)cpus : 1;
+    }
+    // Без -R каталогов ровно столько, сколько аргументов.
+    if (!recursive && jobs > root_count) {
+        jobs = root_count;
+    }
+
+    // localtime_r, в отличие от localtime, не обязана читать TZ сама.
+    tzset();
+    current_time = time(NULL);
+    init_permission_table();
+    if ((diff_path && load_snapshot(diff_path) != 0) || (watch_mode && start_watch() != 0)) {
+        return 1;
+    }
+    // Снимок пишется рядом и заменяет старый только целиком: --diff и
+    // --snapshot могут указывать на один файл.
+    char *snapshot_temp = NULL;
+    if (snapshot_path) {
+        size_t length = strlen(snapshot_path);
+        snapshot_temp = malloc(length + sizeof(".tmp"));
+        if (!snapshot_temp) {
+            fprintf(stderr, "Ошибка: не удалось выделить память\n");
+            return 1;
+        }
+        memcpy(snapshot_temp, snapshot_path, length);
+        memcpy(snapshot_temp + length, ".tmp", sizeof(".tmp"));
+        snapshot_header header = {SNAPSHOT_MAGIC, SNAPSHOT_VERSION, (int64_t)current_time};
+        snapshot_file = fopen(snapshot_temp, "wb");
+        if (!snapshot_file || fwrite(&header, sizeof(header), 1, snapshot_file) != 1) {
+            fprintf(stderr, "Ошибка: не удалось создать снимок %s\n", snapshot_temp);
+            return 1;
+        }
+    }
+    dir_node **roots = calloc(root_count, sizeof(dir_node *));
+    walkers = calloc(jobs, sizeof(walker));
+    if (!roots || !walkers || posix_memalign((void **)&node_deques, 64, jobs * sizeof(node_deque)) != 0) {
+        fprintf(stderr, "Ошибка: не удалось выделить память\n");
+        return 1;
+    }
+    for (int i = 0; i < jobs; i++) {
+        memset(&node_deques[i], 0, sizeof(node_deque));
+        pthread_mutex_init(&node_deques[i].lock, NULL);
+        walkers[i].id = i;
+        walkers[i].next_victim = (i + 1) % jobs;
+        walkers[i].dents = malloc(DENTS_BUFFER_SIZE);
+        walkers[i].fiemap = new_fiemap_buffer();
+        for (int slot = 0; slot < DATE_CACHE_SIZE; slot++) {
+            walkers[i].dates[slot].key = LLONG_MIN;
+        }
+        if (du_mode && top_limit > 0) {
+            walkers[i].top = malloc(top_limit * sizeof(top_file));
+        }
+        if (!walkers[i].dents || !walkers[i].fiemap || (du_mode && top_limit > 0 && !walkers[i].top)) {
+            fprintf(stderr, "Ошибка: не удалось выделить память\n");
+            return 1;
+        }
+    }
+    for (int i = 0; i < LINK_SHARDS; i++) {
+        pthread_mutex_init(&link_shards[i].lock, NULL);
+    }
+    atomic_init(&dirs_pending, root_count);
+    atomic_init(&stop_walk, 0);
+    for (int i = 0; i < root_count; i++) {
+        roots[i] = new_node(NULL, argv[optind + i], NULL);
+        if (!roots[i] || deque_push(&node_deques[i % jobs], roots[i]) != 0) {
+            fprintf(stderr, "Ошибка: не удалось выделить память\n");
+            return 1;
+        }
+    }
+
+    for (int i = 0; i < jobs; i++) {
+        if (pthread_create(&walkers[i].thread, NULL, walk_worker, &walkers[i]) != 0) {
+            fprintf(stderr, "Ошибка: не удалось создать поток %d\n", i);
+            return 1;
+        }
+    }
+    if (output_format == FORMAT_BINARY) {
+        uint32_t version = BINARY_VERSION;
+        emit_bytes(BINARY_MAGIC, 4);
+        emit_bytes((const char *)&version, sizeof(version));
+    }
+    // Итогам --du нужно всё дерево, поэтому они выводятся после обхода.
+    int status = du_mode ? 0 : emit_tree(roots, root_count);
+    for (int i = 0; i < jobs; i++) {
+        pthread_join(walkers[i].thread, NULL);
+    }
+    if (du_mode) {
+        status = report_disk_usage(roots, root_count);
+    }
+    if (snapshot_file) {
+        // Оборванный обход не должен подменить полный снимок.
+        int broken = fclose(snapshot_file) != 0;
+        if (broken) {
+            fprintf(stderr, "Ошибка: не удалось записать снимок %s\n", snapshot_temp);
+        }
+        if (broken || atomic_load(&stop_walk) || rename(snapshot_temp, snapshot_path) != 0) {
+            if (!broken && !atomic_load(&stop_walk)) {
+                fprintf(stderr, "Ошибка: не удалось сохранить снимок %s\n", snapshot_path);
+            }
+            unlink(snapshot_temp);
+            status = 1;
+        }
+        free(snapshot_temp);
+    }
+    if (watch_mode && !atomic_load(&stop_walk)) {
+        status |= run_watch(&walkers[0]);
+    }
+    for (int i = 0; i < jobs; i++) {
+        pthread_mutex_destroy(&node_deques[i].lock);
+        free(node_deques[i].items);
+        free(walkers[i].dents);
+        free(walkers[i].fiemap);
+        free(walkers[i].entries);
+        free(walkers[i].names);
+        free(walkers[i].keys);
+        free(walkers[i].scratch);
+        free_name_cache(&walkers[i].user_names);
+        free_name_cache(&walkers[i].group_names);
+        for (size_t j = 0; j < walkers[i].top_count; j++) {
+            free(walkers[i].top[j].path);
+        }
+        free(walkers[i].top);
+    }
+    for (int i = 0; i < LINK_SHARDS; i++) {
+        pthread_mutex_destroy(&link_shards[i].lock);
+        for (size_t slot = 0; slot < link_shards[i].capacity; slot++) {
+            free(link_shards[i].owners[slot].path);
+        }
+        free(link_shards[i].owners);
+    }
+    free(node_deques);
+    free(walkers);
+    free(roots);
+    free_snapshot();
+    free_watch();
+    return status;
 }